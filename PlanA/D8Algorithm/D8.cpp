@@ -7,7 +7,7 @@
 */
 
 
-int D8_main()
+int D8_main(int terrain)
 {
     const char* filename = "../../src/test1.txt";
     ifstream ifs;
@@ -43,74 +43,103 @@ int D8_main()
     vector<vector<int>> Vector(row, vector_tmp);
     vector<int> Result_tmp(col, 0);
     vector<vector<int>> Result(row, Result_tmp);
-    double Sqrt2;
-    double S = 0, N = 0, E = 0, SE = 0, NE = 0, NW = 0, W = 0, SW = 0;
-    Sqrt2 = sqrt(2);
+    //terrain为1时流向扫描中顺便算坡度、坡向、曲率，汇流中算TWI（test1.txt没有边长，按1计）
+    Terrain grid;
+    if (terrain == 1)
+        grid.resize(row, col);
+    D8_direction(src, row, col, Vector, 0, row - 1, 0, col - 1, -9999, terrain == 1 ? &grid : NULL);
+
+    //������������
+    if (terrain == 1)
+        D8_accumulation(Vector, Result, UnitWeight(), &grid);
+    else
+        D8_accumulation(Vector, Result);
+
+    D8_write(Vector, Result);
+    if (terrain == 1)
+        D8_writeTerrain(grid);
+
+    return 0;
+}
+
+//把流向写到direction.txt、汇流量写到river.txt
+void D8_write(const vector<vector<int>>& Vector, const vector<vector<int>>& Result)
+{
+    int row = Vector.size(), col = Vector[0].size();
+    //����������
+    ofstream ofs;
+    ofs.open("./direction.txt", ios::out);
+
     for (int i = 0; i < row; i++) {
-        for (int j = 0; j < col; j++) {
-            S = (i != (row - 1)) ? (src[i][j] - src[i + 1][j]) : -1;
-            SE = (i != (row - 1) && j != (col - 1)) ? (src[i][j] - src[i + 1][j + 1]) / sqrt(2) : -1;
-            N = (i != 0) ? (src[i][j] - src[i - 1][j]) : -1;
-            E = (j != (col - 1)) ? (src[i][j] - src[i][j + 1]) : -1;
-            NE = (i != 0 && j != (col - 1)) ? (src[i][j] - src[i - 1][j + 1]) / sqrt(2) : -1;
-            NW = (i != 0 && j != 0) ? (src[i][j] - src[i - 1][j - 1]) / sqrt(2) : -1;
-            W = (j != 0) ? (src[i][j] - src[i][j - 1]) : -1;
-            SW = (i != (row - 1) && j != 0) ? (src[i][j] - src[i + 1][j - 1]) / sqrt(2) : -1;
-            
-            //�½�����
-            double M = 0;
-            M = (M > S) ? M : S;
-            M = (M > SE) ? M : SE;
-            M = (M > N) ? M : N;
-            M = (M > E) ? M : E;
-            M = (M > NE) ? M : NE;
-            M = (M > NW) ? M : NW;
-            M = (M > W) ? M : W;
-            M = (M > SW) ? M : SW;
+        for (int j = 0; j < col; j++)
+            ofs << Vector[i][j] << "  ";
+        ofs << endl;
+    }
+    ofs.close();
 
-            //ȡ����½�
-            if (M > 0) {
-                if (M == S)
-                {
-                    Vector[i][j] = 4;
-                }
-                else if (M == SE)
-                {
-                    Vector[i][j] = 2;
-                }
-                else if (M == N)
-                {
-                    Vector[i][j] = 64;
-                }
-                else if (M == E)
-                {
-                    Vector[i][j] = 1;
-                }
-                else if (M == NE)
-                {
-                    Vector[i][j] = 128;
-                }
-                else if (M == NW)
-                {
-                    Vector[i][j] = 32;
-                }
-                else if (M == W)
-                {
-                    Vector[i][j] = 16;
-                }
-                else if (M == SW)
-                {
-                    Vector[i][j] = 8;
-                }
-                else
-                {
-                    Vector[i][j] = 0;
-                }
-            }
-        }
+    //����������
+    ofstream ofs1;
+    ofs1.open("./river.txt", ios::out);
+    for (int i = 0; i < row; i++) {
+        for (int j = 0; j < col; j++)
+            ofs1 << Result[i][j] << "  ";
+        ofs1 << endl;
     }
+    ofs1.close();
+}
 
-    //������������
+bool D8_readGrid(const char* filename, int row, int col, vector<vector<double>>& grid)
+{
+    ifstream ifs;
+    ifs.open(filename, ios::in);
+    if (!ifs.is_open()) {
+        cout << "无法打开" << filename << endl;
+        return false;
+    }
+    string label;
+    int ncols = 0, nrows = 0;
+    double value;
+    ifs >> label >> ncols >> label >> nrows;
+    for (int k = 0; k < 4; k++)
+        ifs >> label >> value;
+    if (ncols != col || nrows != row) {
+        cout << filename << "为" << nrows << "×" << ncols << "，应为" << row << "×" << col << endl;
+        return false;
+    }
+    grid.assign(row, vector<double>(col, 0));
+    for (int i = 0; i < row; i++)
+        for (int j = 0; j < col; j++)
+            ifs >> grid[i][j];
+    if (!ifs) {
+        cout << filename << "数据不完整" << endl;
+        return false;
+    }
+    return true;
+}
+
+void D8_writeGrid(const char* filename, const vector<vector<double>>& grid)
+{
+    ofstream ofs;
+    ofs.open(filename, ios::out);
+    for (size_t i = 0; i < grid.size(); i++) {
+        for (size_t j = 0; j < grid[i].size(); j++)
+            ofs << grid[i][j] << "  ";
+        ofs << endl;
+    }
+    ofs.close();
+}
+
+void D8_writeTerrain(const Terrain& terrain)
+{
+    D8_writeGrid("./slope.txt", terrain.slope);
+    D8_writeGrid("./aspect.txt", terrain.aspect);
+    D8_writeGrid("./curvature.txt", terrain.curvature);
+    D8_writeGrid("./twi.txt", terrain.twi);
+}
+
+void D8_accumulation(const vector<vector<int>>& Vector, vector<vector<int>>& Result)
+{
+    int row = Vector.size(), col = Vector[0].size();
     int i1 = 0, j1 = 0;
     for (int i = 0; i < row; i++) {
         for (int j = 0; j < col; j++) {
@@ -123,8 +152,6 @@ int D8_main()
                 }
                 switch (x)
                 {
-                    //temp = 0
-                    Vector[i1][j1] |= 0x100000;
                 case 1:
                 {
                     Result[i1][j1 + 1]++;
@@ -180,28 +207,4 @@ int D8_main()
             }
         }
     }
-
-    //����������
-    ofstream ofs;
-    ofs.open("./direction.txt", ios::out);
-
-    for (int i = 0; i < row; i++) {
-        for (int j = 0; j < col; j++)
-            ofs << Vector[i][j] << "  ";
-        ofs << endl;
-    }
-    ofs.close();
-
-    //����������
-    ofstream ofs1;
-    ofs1.open("./river.txt", ios::out);
-    for (int i = 0; i < row; i++) {
-        for (int j = 0; j < col; j++)
-            ofs1 << Result[i][j] << "  ";
-        ofs1 << endl;
-    }
-    ofs1.close();
-
-
-    return 0;
 }
@@ -5,8 +5,249 @@
 #include<vector>
 #include<sstream>
 #include<ctime>
+#include<cmath>
+#include<type_traits>
 
 using namespace std;
 
-int D8_main();
+int D8_main(int terrain = 0);
 
+//地形因子：坡度、坡向（度）、曲率和地形湿度指数TWI，nodata像元取nodata
+struct Terrain {
+    double cellsize = 1;
+    double nodata = -9999;
+    vector<vector<double>> slope, aspect, curvature, twi;
+
+    void resize(int row, int col)
+    {
+        slope.assign(row, vector<double>(col, 0));
+        aspect.assign(row, vector<double>(col, 0));
+        curvature.assign(row, vector<double>(col, 0));
+        twi.assign(row, vector<double>(col, 0));
+    }
+};
+
+//由3×3窗口计算(i,j)的坡度、坡向和曲率，窗口中在栅格外或为nodata的邻域取中心高程。
+//坡度、坡向按Horn方法，坡向从北顺时针，平地为-1；曲率按Zevenbergen-Thorne，与ArcGIS相同（×100）
+template<typename Grid>
+inline void D8_terrainCell(const Grid& src, int row, int col, int i, int j, double nodata, Terrain& terrain)
+{
+    double e = src[i][j];
+    auto at = [&](int ni, int nj) {
+        return (ni >= 0 && ni < row && nj >= 0 && nj < col && src[ni][nj] != nodata) ? (double)src[ni][nj] : e;
+    };
+    double a = at(i - 1, j - 1), b = at(i - 1, j), c = at(i - 1, j + 1);
+    double d = at(i, j - 1), f = at(i, j + 1);
+    double g = at(i + 1, j - 1), h = at(i + 1, j), k = at(i + 1, j + 1);
+    double L = terrain.cellsize;
+    double dzdx = ((c + 2 * f + k) - (a + 2 * d + g)) / (8 * L);
+    double dzdy = ((g + 2 * h + k) - (a + 2 * b + c)) / (8 * L);
+    const double degree = 180.0 / 3.14159265358979323846;
+    terrain.slope[i][j] = atan(sqrt(dzdx * dzdx + dzdy * dzdy)) * degree;
+    if (dzdx == 0 && dzdy == 0) {
+        terrain.aspect[i][j] = -1;
+    }
+    else {
+        double angle = atan2(dzdy, -dzdx) * degree;
+        terrain.aspect[i][j] = angle > 90 ? 450 - angle : 90 - angle;
+    }
+    double D = ((d + f) / 2 - e) / (L * L);
+    double E = ((b + h) / 2 - e) / (L * L);
+    terrain.curvature[i][j] = -2 * (D + E) * 100;
+}
+
+//D8编码下一个像元的行列偏移，0表示出口
+inline bool D8_step(int dir, int& i, int& j)
+{
+    switch (dir)
+    {
+    case 1: j++; return true;
+    case 2: i++; j++; return true;
+    case 4: i++; return true;
+    case 8: i++; j--; return true;
+    case 16: j--; return true;
+    case 32: i--; j--; return true;
+    case 64: i--; return true;
+    case 128: i--; j++; return true;
+    default: return false;
+    }
+}
+
+//计算[i0,i1]行、[j0,j1]列范围内的D8流向，src可以是任意支持src[i][j]的栅格
+//值为nodata的像元流向为0，与栅格外一样不接收水流，其相邻像元在没有更低的邻域时成为出口
+//terrain不为NULL时在同一遍扫描中顺便算出坡度、坡向和曲率，邻域已在缓存中，不用再读一遍DEM
+template<typename Grid>
+void D8_direction(const Grid& src, int row, int col, vector<vector<int>>& Vector, int i0, int i1, int j0, int j1, double nodata = -9999,
+    Terrain* terrain = NULL)
+{
+    double S = 0, N = 0, E = 0, SE = 0, NE = 0, NW = 0, W = 0, SW = 0;
+    for (int i = i0; i <= i1; i++) {
+        for (int j = j0; j <= j1; j++) {
+            if (src[i][j] == nodata) {
+                Vector[i][j] = 0;
+                if (terrain != NULL)
+                    terrain->slope[i][j] = terrain->aspect[i][j] = terrain->curvature[i][j] = terrain->nodata;
+                continue;
+            }
+            if (terrain != NULL)
+                D8_terrainCell(src, row, col, i, j, nodata, *terrain);
+            //邻域在栅格外或为nodata时坡度取-1
+            auto drop = [&](bool inside, int ni, int nj, double dist) {
+                return (inside && src[ni][nj] != nodata) ? (src[i][j] - src[ni][nj]) / dist : -1;
+            };
+            S = drop(i != (row - 1), i + 1, j, 1);
+            SE = drop(i != (row - 1) && j != (col - 1), i + 1, j + 1, sqrt(2));
+            N = drop(i != 0, i - 1, j, 1);
+            E = drop(j != (col - 1), i, j + 1, 1);
+            NE = drop(i != 0 && j != (col - 1), i - 1, j + 1, sqrt(2));
+            NW = drop(i != 0 && j != 0, i - 1, j - 1, sqrt(2));
+            W = drop(j != 0, i, j - 1, 1);
+            SW = drop(i != (row - 1) && j != 0, i + 1, j - 1, sqrt(2));
+
+            //下降坡度
+            double M = 0;
+            M = (M > S) ? M : S;
+            M = (M > SE) ? M : SE;
+            M = (M > N) ? M : N;
+            M = (M > E) ? M : E;
+            M = (M > NE) ? M : NE;
+            M = (M > NW) ? M : NW;
+            M = (M > W) ? M : W;
+            M = (M > SW) ? M : SW;
+
+            //取最大下降
+            Vector[i][j] = 0;
+            if (M > 0) {
+                if (M == S)
+                {
+                    Vector[i][j] = 4;
+                }
+                else if (M == SE)
+                {
+                    Vector[i][j] = 2;
+                }
+                else if (M == N)
+                {
+                    Vector[i][j] = 64;
+                }
+                else if (M == E)
+                {
+                    Vector[i][j] = 1;
+                }
+                else if (M == NE)
+                {
+                    Vector[i][j] = 128;
+                }
+                else if (M == NW)
+                {
+                    Vector[i][j] = 32;
+                }
+                else if (M == W)
+                {
+                    Vector[i][j] = 16;
+                }
+                else if (M == SW)
+                {
+                    Vector[i][j] = 8;
+                }
+            }
+        }
+    }
+}
+
+void D8_accumulation(const vector<vector<int>>& Vector, vector<vector<int>>& Result);
+
+void D8_write(const vector<vector<int>>& Vector, const vector<vector<int>>& Result);
+
+//把坡度、坡向、曲率、TWI分别写到slope.txt、aspect.txt、curvature.txt、twi.txt
+void D8_writeTerrain(const Terrain& terrain);
+
+//读入与test.txt格式相同（6行文件头）的row×col格网，打不开或大小不符时返回false
+bool D8_readGrid(const char* filename, int row, int col, vector<vector<double>>& grid);
+
+void D8_writeGrid(const char* filename, const vector<vector<double>>& grid);
+
+//单位权重：汇流量即上游像元个数
+struct UnitWeight {
+    static const bool lossy = false;
+    double operator()(int, int) const { return 1; }
+    double retained(int, int) const { return 1; }
+};
+
+//降雨量×径流系数作为权重，loss为每个像元流出时损失的比例，runoff、loss可以为NULL
+struct RunoffWeight {
+    static const bool lossy = true;
+    const vector<vector<double>>* rainfall;
+    const vector<vector<double>>* runoff;
+    const vector<vector<double>>* loss;
+    double operator()(int i, int j) const { return (*rainfall)[i][j] * (runoff ? (*runoff)[i][j] : 1.0); }
+    double retained(int i, int j) const { return loss ? 1.0 - (*loss)[i][j] : 1.0; }
+};
+
+//地形湿度指数，坡度过小时按0.001的坡降计算，避免平地上趋于无穷
+inline double D8_twi(const Terrain& terrain, int i, int j, double accumulation)
+{
+    if (terrain.slope[i][j] == terrain.nodata)
+        return terrain.nodata;
+    double tanb = tan(terrain.slope[i][j] * 3.14159265358979323846 / 180.0);
+    return log((accumulation + 1) * terrain.cellsize / (tanb > 0.001 ? tanb : 0.001));
+}
+
+//浮点累加使用Neumaier补偿求和，整数直接相加
+template<typename T>
+inline void D8_add(T& sum, T& carry, T value)
+{
+    if constexpr (std::is_floating_point<T>::value) {
+        T t = sum + value;
+        if (std::fabs(sum) >= std::fabs(value))
+            carry += (sum - t) + value;
+        else
+            carry += (value - t) + sum;
+        sum = t;
+    }
+    else {
+        sum += value;
+    }
+}
+
+//加权汇流：按拓扑顺序（入度为0的像元先出队，行优先）逐个把(汇流量+权重)×保留比例传给下游，
+//每个像元只处理一次，顺序固定，浮点结果可复现。单位权重时与D8_accumulation结果相同
+//terrain不为NULL时，像元出队时汇流量已经算完，顺便算出TWI = ln(a / tanβ)，
+//a为单位等高线长度的汇水面积(汇流量+1)×边长，β为D8_direction算出的坡度
+template<typename T, typename Weight>
+void D8_accumulation(const vector<vector<int>>& Vector, vector<vector<T>>& Result, const Weight& weight, Terrain* terrain = NULL)
+{
+    int row = Vector.size(), col = Vector[0].size();
+    vector<int> indegree(row * col, 0);
+    vector<T> carry(row * col, 0);
+    vector<int> order;
+    order.reserve(row * col);
+    for (int i = 0; i < row; i++) {
+        for (int j = 0; j < col; j++) {
+            Result[i][j] = 0;
+            int i1 = i, j1 = j;
+            if (D8_step(Vector[i][j], i1, j1))
+                indegree[i1 * col + j1]++;
+        }
+    }
+    for (int k = 0; k < row * col; k++)
+        if (indegree[k] == 0)
+            order.push_back(k);
+    for (size_t head = 0; head < order.size(); head++) {
+        int i = order[head] / col, j = order[head] % col;
+        if (terrain != NULL)
+            terrain->twi[i][j] = D8_twi(*terrain, i, j, (double)Result[i][j] + (double)carry[i * col + j]);
+        int i1 = i, j1 = j;
+        if (!D8_step(Vector[i][j], i1, j1))
+            continue;
+        T outflow = Result[i][j] + carry[i * col + j] + (T)weight(i, j);
+        if (Weight::lossy)
+            outflow = (T)(outflow * weight.retained(i, j));
+        D8_add(Result[i1][j1], carry[i1 * col + j1], outflow);
+        if (--indegree[i1 * col + j1] == 0)
+            order.push_back(i1 * col + j1);
+    }
+    for (int i = 0; i < row; i++)
+        for (int j = 0; j < col; j++)
+            Result[i][j] += carry[i * col + j];
+}
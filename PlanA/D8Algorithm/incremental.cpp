@@ -0,0 +1,156 @@
+#include "incremental.h"
+#include <deque>
+
+static DirtyRect expandRect(DirtyRect r, int halo)
+{
+	r.y0 = (r.y0 - halo < 1) ? 1 : r.y0 - halo;
+	r.x0 = (r.x0 - halo < 1) ? 1 : r.x0 - halo;
+	r.y1 = (r.y1 + halo > N) ? N : r.y1 + halo;
+	r.x1 = (r.x1 + halo > M) ? M : r.x1 + halo;
+	return r;
+}
+
+static DirtyRect unionRect(DirtyRect a, DirtyRect b)
+{
+	if (b.y0 < a.y0) a.y0 = b.y0;
+	if (b.x0 < a.x0) a.x0 = b.x0;
+	if (b.y1 > a.y1) a.y1 = b.y1;
+	if (b.x1 > a.x1) a.x1 = b.x1;
+	return a;
+}
+
+DirtyRect resetFilledRegion(double** raw, DirtyRect rect)
+{
+	//从编辑区出发，把与之八邻接、曾被pfs改动过的像元还原为原始高程，受影响的洼地整体重新填充
+	DirtyRect box = rect;
+	int x, y, dxo, dyo;
+	vector<char> seen((M + 2) * (N + 2), 0);
+	deque<int> q;
+	for (y = rect.y0; y <= rect.y1; y++)
+	{
+		for (x = rect.x0; x <= rect.x1; x++)
+		{
+			z[y][x] = raw[y][x];
+			seen[y * (M + 2) + x] = 1;
+			q.push_back(y * (M + 2) + x);
+		}
+	}
+	while (!q.empty())
+	{
+		int k = q.front();
+		q.pop_front();
+		y = k / (M + 2);
+		x = k % (M + 2);
+		for (dyo = -1; dyo <= 1; dyo++)
+		{
+			for (dxo = -1; dxo <= 1; dxo++)
+			{
+				int ny = y + dyo, nx = x + dxo;
+				if (ny < 1 || ny > N || nx < 1 || nx > M || seen[ny * (M + 2) + nx])
+					continue;
+				seen[ny * (M + 2) + nx] = 1;
+				if (z[ny][nx] != raw[ny][nx])
+				{
+					z[ny][nx] = raw[ny][nx];
+					DirtyRect cell = { ny, nx, ny, nx };
+					box = unionRect(box, cell);
+					q.push_back(ny * (M + 2) + nx);
+				}
+			}
+		}
+	}
+	initializeOkPit();
+	return box;
+}
+
+DirtyRect refillRegion(DirtyRect box)
+{
+	//只在改动范围外扩一圈内找洼地，新的洼地只会出现在上一轮被修改的像元旁边
+	DirtyRect done = box;
+	int x, y;
+	if (zi == NULL)
+		zi = (pHeapNode*)bigAlloc(sizeof(pHeapNode) * ((M + 2) * (N + 2) + 1));
+	do
+	{
+		DirtyRect scan = expandRect(box, 1);
+		ni = 0;
+		for (y = scan.y0; y <= scan.y1; y++)
+		{
+			for (x = scan.x0; x <= scan.x1; x++)
+			{
+				if (pointIsPit(y, x, z) == 1)
+				{
+					addPit(y, x);
+				}
+			}
+		}
+		resetTouched();
+		fixinvalidpits(zi);
+		if (touchY1 < touchY0)
+			break;
+		box.y0 = touchY0;
+		box.x0 = touchX0;
+		box.y1 = touchY1;
+		box.x1 = touchX1;
+		box = expandRect(box, 0);
+		done = unionRect(done, box);
+	} while (ni != 0);
+	return done;
+}
+
+void moveAccumulation(vector<vector<int>>& Vector, vector<vector<int>>& Result, int i, int j, int dir)
+{
+	//把(i,j)及其上游的汇流量沿当前流向加到（dir=1）或减出（dir=-1）下游路径
+	int amount = dir * (Result[i][j] + 1);
+	while (D8_step(Vector[i][j], i, j))
+	{
+		Result[i][j] += amount;
+	}
+}
+
+DirtyRect incrementalUpdate(double** raw, DirtyRect rect, vector<vector<int>>& Vector, vector<vector<int>>& Result)
+{
+	int i, j;
+	size_t k;
+	DirtyRect box = resetFilledRegion(raw, rect);
+	box = refillRegion(box);
+	//流向取决于八邻域，重算范围外扩一圈
+	box = expandRect(box, 1);
+	int i0 = box.y0 - 1, i1 = box.y1 - 1, j0 = box.x0 - 1, j1 = box.x1 - 1;
+
+	vector<vector<int>> old(i1 - i0 + 1, vector<int>(j1 - j0 + 1, 0));
+	for (i = i0; i <= i1; i++)
+		for (j = j0; j <= j1; j++)
+			old[i - i0][j - j0] = Vector[i][j];
+
+	FilledGrid grid = { z };
+	D8_direction(grid, N, M, Vector, i0, i1, j0, j1, nodata);
+
+	vector<pair<int, int>> changed;
+	vector<int> newDir;
+	for (i = i0; i <= i1; i++)
+	{
+		for (j = j0; j <= j1; j++)
+		{
+			if (Vector[i][j] != old[i - i0][j - j0])
+			{
+				changed.push_back(make_pair(i, j));
+				newDir.push_back(Vector[i][j]);
+				Vector[i][j] = old[i - i0][j - j0];
+			}
+		}
+	}
+
+	//先把流向改变的像元从旧下游摘掉，再接到新下游；中间状态都是新流向树的子图，不会出现环
+	for (k = 0; k < changed.size(); k++)
+	{
+		moveAccumulation(Vector, Result, changed[k].first, changed[k].second, -1);
+		Vector[changed[k].first][changed[k].second] = 0;
+	}
+	for (k = 0; k < changed.size(); k++)
+	{
+		Vector[changed[k].first][changed[k].second] = newDir[k];
+		moveAccumulation(Vector, Result, changed[k].first, changed[k].second, 1);
+	}
+	return box;
+}
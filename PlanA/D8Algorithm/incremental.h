@@ -0,0 +1,26 @@
+#pragma once
+#include "pfs.h"
+#include "D8.h"
+
+//编辑区域，闭区间，使用pfs网格坐标（行1..N，列1..M）
+struct DirtyRect {
+	int y0, x0, y1, x1;
+};
+
+//把pfs的z（带一圈边界）映射成D8_direction使用的0起始行列
+struct FilledGrid {
+	double** z;
+	const double* operator[](int i) const { return z[i + 1] + 1; }
+};
+
+//raw为未填洼的DEM（与z相同布局），调用前已把编辑写入rect范围。
+//z、Vector、Result为上一次pfs+D8+汇流的结果，原地更新，返回流向被重算的范围
+//pfs按洼地排好的顺序逐个开挖，结果与处理顺序有关：更新后的z没有洼地，流向和汇流与z一致，
+//但范围内个别像元可能与整幅重新计算的结果不同
+DirtyRect incrementalUpdate(double** raw, DirtyRect rect, vector<vector<int>>& Vector, vector<vector<int>>& Result);
+
+DirtyRect resetFilledRegion(double** raw, DirtyRect rect);
+
+DirtyRect refillRegion(DirtyRect box);
+
+void moveAccumulation(vector<vector<int>>& Vector, vector<vector<int>>& Result, int i, int j, int dir);
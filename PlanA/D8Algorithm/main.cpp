@@ -1,11 +1,113 @@
 ﻿#include "pfs.h"
 #include "D8.h"
+#include "pipeline.h"
 
 using namespace std;
 
-int main()
+int main(int argc, char* argv[])
 {
-    D8_main();
-    pfs();
+    //--breach 最大开挖深度 最大开挖长度
+    //--checkpoint 检查点文件 间隔秒数，--resume 从检查点文件继续
+    //--huge-pages 格网数组使用透明大页
+    //默认在内存中依次填洼、计算流向和汇流；--dump-filled 另外写出填洼结果Gridout.txt，
+    //--separate 按原来的方式分别运行D8（读test1.txt）和pfs
+    //--terrain 另外写出坡度、坡向、曲率和TWI：slope.txt、aspect.txt、curvature.txt、twi.txt
+    //--edit 起始行 起始列 结束行 结束列 高程：把该矩形（从0开始，含两端）的高程改为给定值，
+    //在原DEM的结果上增量更新后写出，不能与--terrain、--separate同用
+    //--rainfall 降雨格网 [--runoff 径流系数格网] [--loss 损失比例格网]：另外按降雨×径流系数加权汇流，
+    //写到runoff.txt，格网与test.txt格式相同，不能与--separate同用
+    char* checkpoint = NULL;
+    double interval = 300.0;
+    int resume = 0;
+    int dumpFilled = 0;
+    int separate = 0;
+    int terrain = 0;
+    DirtyRect edit;
+    double editZ = 0;
+    int editing = 0;
+    RunoffFiles files;
+    for (int i = 1; i < argc; i++)
+    {
+        if (string(argv[i]) == "--breach" && i + 2 < argc)
+        {
+            setBreaching(atof(argv[i + 1]), atof(argv[i + 2]));
+            i += 2;
+        }
+        else if (string(argv[i]) == "--checkpoint" && i + 2 < argc)
+        {
+            checkpoint = argv[i + 1];
+            interval = atof(argv[i + 2]);
+            i += 2;
+        }
+        else if (string(argv[i]) == "--resume")
+        {
+            resume = 1;
+        }
+        else if (string(argv[i]) == "--huge-pages")
+        {
+            setHugePages(1);
+        }
+        else if (string(argv[i]) == "--dump-filled")
+        {
+            dumpFilled = 1;
+        }
+        else if (string(argv[i]) == "--separate")
+        {
+            separate = 1;
+        }
+        else if (string(argv[i]) == "--terrain")
+        {
+            terrain = 1;
+        }
+        else if (string(argv[i]) == "--rainfall" && i + 1 < argc)
+        {
+            files.rainfall = argv[++i];
+        }
+        else if (string(argv[i]) == "--runoff" && i + 1 < argc)
+        {
+            files.runoff = argv[++i];
+        }
+        else if (string(argv[i]) == "--loss" && i + 1 < argc)
+        {
+            files.loss = argv[++i];
+        }
+        else if (string(argv[i]) == "--edit" && i + 5 < argc)
+        {
+            //pfs格网坐标从1开始
+            edit.y0 = atoi(argv[i + 1]) + 1;
+            edit.x0 = atoi(argv[i + 2]) + 1;
+            edit.y1 = atoi(argv[i + 3]) + 1;
+            edit.x1 = atoi(argv[i + 4]) + 1;
+            editZ = atof(argv[i + 5]);
+            editing = 1;
+            i += 5;
+        }
+    }
+    if (editing == 1 && (terrain == 1 || separate == 1))
+    {
+        printf("--edit不能与--terrain、--separate同用\n");
+        return 1;
+    }
+    if ((files.runoff != NULL || files.loss != NULL) && files.rainfall == NULL)
+    {
+        printf("--runoff和--loss需要--rainfall\n");
+        return 1;
+    }
+    if (files.rainfall != NULL && separate == 1)
+    {
+        printf("--rainfall不能与--separate同用\n");
+        return 1;
+    }
+    if (checkpoint != NULL)
+        setCheckpoint(checkpoint, interval, resume);
+    if (separate == 1)
+    {
+        D8_main(terrain);
+        pfs();
+    }
+    else
+    {
+        return pipeline(dumpFilled, terrain, editing == 1 ? &edit : NULL, editZ, files);
+    }
     return 0;
 }
\ No newline at end of file
@@ -10,9 +10,14 @@ struct offsetRec
 struct offsetRec ofs[8] = { 1, 0, -1, 1, 0, -1, 1, 1, -1, 0, 1, -1, 0, 1, -1, -1 };
 int nChan, nSink, npq, nVertex;
 
-pVertex** pq;
+pHeapNode* pq;
 pVertex*** adj;
+pVertex* arena = NULL;
+pVertex** path = NULL;
+int breachMode = 0;
+double maxBreachDepth = 0.0, maxBreachLength = 0.0;
 #define onTree 0
+#define onFill -1
 double dz = 0.0001;
 int M;
 int N;
@@ -27,7 +32,70 @@ char yllcorner_label[15];
 char cellsize[15];
 char NODATA_value[15];
 double** z = NULL;
-double** zi;
+pHeapNode* zi = NULL;
+int touchY0, touchX0, touchY1, touchX1;
+int pass = 0;
+
+//㣺׷дĶ־ÿ鿪ʼʱźݵأS¼֮ÿһʱ
+//ϴĶĸһҪݵأP¼ÿ¼Խβϵ
+//һ¼ɻָдֻʱڵĸĶй
+#define CKPT_END 0x444E4521
+char* checkpointFile = NULL;
+double checkpointInterval = 300.0;
+int resumeMode = 0;
+FILE* ckpt = NULL;
+time_t lastCheckpoint;
+char* dirtyFlag = NULL;//ϴμĶĸ
+int* dirtyList = NULL;
+int nDirty = 0;
+int resumePit = -1;//ָʱŴݵţ-1ʾʼһ
+int hugePages = 0;
+double** raw = NULL;
+int keepRaw = 0;
+
+//ҳzadjpqzi⼸һڴLinuxϵӳ䣬madvise͸ҳ
+//һ2MBҳֻռһTLBʱTLBȱʧٵöࡣϵͳmalloc
+void setHugePages(int on)
+{
+	hugePages = on;
+}
+
+void* bigAlloc(size_t size)
+{
+#ifdef __linux__
+	if (hugePages == 1)
+	{
+		void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED)
+		{
+#ifdef MADV_HUGEPAGE
+			madvise(p, size, MADV_HUGEPAGE);
+#endif
+			return p;
+		}
+	}
+#endif
+	return malloc(size);
+}
+
+//ԭʼDEMonΪ1ʱpfsFillǰzƵraw»ԭԪ
+void setKeepRaw(int on)
+{
+	keepRaw = on;
+}
+
+//sizebigAllocʱͬҳڼ䲻ܸĶhugePages
+void bigFree(void* p, size_t size)
+{
+#ifdef __linux__
+	if (hugePages == 1)
+	{
+		munmap(p, size);
+		return;
+	}
+#endif
+	free(p);
+}
 
 void readzgrid(char* infile)
 {
@@ -45,7 +113,7 @@ void readzgrid(char* infile)
 	fscanf(fp, "%s %lf", &cellsize, &dx);
 	fscanf(fp, "%s %d", &NODATA_value, &nodata);
 	z = (double**)malloc(sizeof(double*) * (N + 2));//ָ
-	z[0] = (double*)malloc((M + 2) * (N + 2) * sizeof(double));
+	z[0] = (double*)bigAlloc((size_t)(M + 2) * (N + 2) * sizeof(double));
 	for (i = 1; i <= N + 1; i++)
 	{
 		z[i] = z[i - 1] + M + 2;
@@ -60,10 +128,10 @@ void readzgrid(char* infile)
 		fscanf(fp, "\n");
 	}
 	mul = (M + 2) * (N + 2);
-	zi = (double**)malloc(sizeof(double*) * mul);
-	pq = (pVertex**)malloc(sizeof(pVertex*) * mul);
+	zi = (pHeapNode*)bigAlloc(sizeof(pHeapNode) * (mul + 1));
+	pq = (pHeapNode*)bigAlloc(sizeof(pHeapNode) * (mul + 1));
 	adj = (pVertex***)malloc(sizeof(pVertex**) * (N + 2));
-	adj[0] = (pVertex**)malloc((M + 2) * (N + 2) * sizeof(pVertex*));
+	adj[0] = (pVertex**)bigAlloc((size_t)(M + 2) * (N + 2) * sizeof(pVertex*));
 	for (i = 1; i <= N + 1; i++)
 	{
 		adj[i] = adj[i - 1] + M + 2;//ÿָָ
@@ -81,18 +149,24 @@ void initHorizOffsets()
 	}
 }
 
+//Ȧڸ0.5ڸΪʱȦҲΪ
+double ringValue(double zEdge)
+{
+	return zEdge == nodata ? nodata : zEdge - 0.5;
+}
+
 void initializeOkPit()
 {
 	int x, y;
 	for (y = 1; y <= N; y++)
 	{
-		z[y][0] = z[y][1] - 0.5;
-		z[y][M + 1] = z[y][M] - 0.5;
+		z[y][0] = ringValue(z[y][1]);
+		z[y][M + 1] = ringValue(z[y][M]);
 	}
 	for (x = 0; x <= M + 1; x++)
 	{
-		z[0][x] = z[1][x] - 0.5;
-		z[N + 1][x] = z[N][x] - 0.5;
+		z[0][x] = ringValue(z[1][x]);
+		z[N + 1][x] = ringValue(z[N][x]);
 	}
 }
 
@@ -106,15 +180,17 @@ void printpit(int y, int x, FILE* out)
 int pointIsPit(int y, int x, double** z)
 {
 	int d;
-	double z0;
+	double z0, zn;
 	z0 = z[y][x];
 
-	if (y == 0 || y == N + 1 || x == 0 || x == M + 1 || z0 == -9999)
+	if (y == 0 || y == N + 1 || x == 0 || x == M + 1 || z0 == nodata)
 		return 0;
 
 	for (d = 0; d <= 7; d++)
 	{
-		if (z[y + ofs[d].oy][x + ofs[d].ox] < z0)
+		zn = z[y + ofs[d].oy][x + ofs[d].ox];
+		//ȡֵΪͣˮԴ
+		if (zn == nodata || zn < z0)
 		{
 			return 0;
 		}
@@ -122,96 +198,115 @@ int pointIsPit(int y, int x, double** z)
 	return 1;
 }
 
-bool higherPriority(pVertex* v1, pVertex* v2)
+//ȼzRimzGhDistαȽϣȫʱţ˳Ψһ
+bool higherPriority(pHeapNode* v1, pHeapNode* v2)
+{
+	if (v1->zRim != v2->zRim)
+		return v1->zRim < v2->zRim;
+	if (v1->zG != v2->zG)
+		return v1->zG < v2->zG;
+	if (v1->hDist != v2->hDist)
+		return v1->hDist < v2->hDist;
+	return v1->vi < v2->vi;
+}
+
+//4ѣ±1ʼkӽڵΪ4k-2~4k+1ڵΪ(k+2)/4
+//trackΪ1ʱͬ¼arenaжڶеλqi
+void heapUp(pHeapNode* h, int k, int track)
 {
-	bool result = false;
-	if (v1->zRim < v2->zRim)
-		result = true;
-	else if (v1->zRim == v2->zRim)
+	int p;
+	pHeapNode v = h[k];
+	while (k > 1)
 	{
-		if (v1->zG < v2->zG)
-			result = true;
-		else if (v1->zG == v2->zG)
-		{
-			if (v1->hDist < v2->hDist)
-				result = true;
-		}
+		p = heapParent(k);
+		if (higherPriority(&v, &h[p]) == false)
+			break;
+		h[k] = h[p];
+		if (track)
+			arena[h[k].vi].qi = k;
+		k = p;
 	}
-	return result;
+	h[k] = v;
+	if (track)
+		arena[h[k].vi].qi = k;
 }
 
-void upHeap(int k)
+void heapDown(pHeapNode* h, int k, int n, int track)
 {
-	pVertex* v = NULL;
-	v = pq[k];
-	while ((k > 1) && higherPriority(v, pq[k / 2]))
+	int c, j, last;
+	pHeapNode v = h[k];
+	while ((c = heapChild(k)) <= n)
 	{
-		pq[k] = pq[k / 2];
-		pq[k]->qi = k;
-		k = k / 2;
+		last = c + HEAP_D - 1;
+		if (last > n)
+			last = n;
+		for (j = c + 1; j <= last; j++)
+			if (higherPriority(&h[j], &h[c]))
+				c = j;
+		if (higherPriority(&h[c], &v) == false)
+			break;
+		h[k] = h[c];
+		if (track)
+			arena[h[k].vi].qi = k;
+		k = c;
 	}
-	pq[k] = v;
-	pq[k]->qi = k;
+	h[k] = v;
+	if (track)
+		arena[h[k].vi].qi = k;
+}
+
+void upHeap(int k)
+{
+	heapUp(pq, k, 1);
 }
 
 void downHeap(int k)
 {
-	int j = 0;
-	pVertex* v = NULL;
-	v = pq[k];
-	while (k <= npq / 2)
-	{
-		j = k + k;
-		if (j < npq)
-			if (higherPriority(pq[j + 1], pq[j]))
-				j++;
-		if (higherPriority(pq[j], v) == false)
-			break;
-		pq[k] = pq[j];
-		pq[k]->qi = k;
-		k = j;
-	}
-	pq[k] = v;
-	pq[k]->qi = k;
+	heapDown(pq, k, npq, 1);
 }
 
-void PQinsert(pVertex* vOnTree, int x, int y, int d)
+//arena½vOnTreeչ(x,y)Ķ㣬
+pVertex* newVertex(pVertex* vOnTree, int x, int y, int d)
 {
-	pVertex* t;
+	pVertex* v;
 	nVertex++;
-	pq[nVertex] = (pVertex*)malloc(sizeof(pVertex));
-	adj[y][x] = pq[nVertex];
-	pq[nVertex]->ix = x;
-	pq[nVertex]->iy = y;
-	pq[nVertex]->zG = z[y][x];
-	pq[nVertex]->zRim = vOnTree->zRim;
-	if (pq[nVertex]->zG > pq[nVertex]->zRim)
-		pq[nVertex]->zRim = pq[nVertex]->zG;
-	pq[nVertex]->hDist = vOnTree->hDist + ofsDist[d];
-	pq[nVertex]->next = vOnTree;
+	v = &arena[nVertex];
+	adj[y][x] = v;
+	v->ix = x;
+	v->iy = y;
+	v->zG = z[y][x];
+	v->zRim = vOnTree->zRim;
+	if (v->zG > v->zRim)
+		v->zRim = v->zG;
+	v->hDist = vOnTree->hDist + ofsDist[d];
+	v->next = vOnTree;
+	return v;
+}
+
+void PQinsert(pVertex* vOnTree, int x, int y, int d)
+{
+	pVertex* v = newVertex(vOnTree, x, y, d);
 	npq++;
-	t = pq[nVertex];
-	pq[nVertex] = pq[npq];
-	pq[npq] = t;
+	pq[npq].zRim = v->zRim;
+	pq[npq].zG = v->zG;
+	pq[npq].hDist = v->hDist;
+	pq[npq].vi = nVertex;
 	upHeap(npq);
 }
 
 pVertex* PQremove()
 {
-	pVertex* result = NULL;
-	pVertex* t;
-	result = pq[1];
-	pq[1]->qi = onTree;
-	t = pq[1];
+	pVertex* result = &arena[pq[1].vi];
+	result->qi = onTree;
 	pq[1] = pq[npq];
-	pq[npq] = t;
 	npq--;
 	if (npq > 0)
 		downHeap(1);
 	return result;
 }
 
-void pqUpdate(pVertex* vOnTree)
+//չvOnTreeݸѣʱΪڣ򷵻NULL
+pVertex* pqUpdate(pVertex* vOnTree)
 {
 	int x = 0, y = 0, d = 0;
 	pVertex* v = NULL;
@@ -222,93 +317,221 @@ void pqUpdate(pVertex* vOnTree)
 		v = adj[y][x];
 		if (v == NULL)
 		{
+			if (z[y][x] == nodata)
+				return newVertex(vOnTree, x, y, d);
 			PQinsert(vOnTree, x, y, d);
 		}
 	}
+	return NULL;
+}
+
+void resetTouched()
+{
+	touchY0 = N + 1;
+	touchX0 = M + 1;
+	touchY1 = 0;
+	touchX1 = 0;
+}
+
+void markTouched(int y, int x)
+{
+	if (y < touchY0) touchY0 = y;
+	if (y > touchY1) touchY1 = y;
+	if (x < touchX0) touchX0 = x;
+	if (x > touchX1) touchX1 = x;
+	if (dirtyFlag != NULL && dirtyFlag[y * (M + 2) + x] == 0)
+	{
+		dirtyFlag[y * (M + 2) + x] = 1;
+		dirtyList[nDirty++] = y * (M + 2) + x;
+	}
+}
+
+void setBreaching(double depth, double length)
+{
+	breachMode = 1;
+	maxBreachDepth = depth;
+	maxBreachLength = length;
+}
+
+int breachPath(pVertex* v, double z0)
+{
+	int n = 0, k, last;
+	double zc = z0, zk, depth = 0.0;
+	if (v->hDist > maxBreachLength)
+		return 0;
+	//ݸʱڵڸΪֹݸ޸
+	last = z[v->iy][v->ix] == nodata ? 1 : 0;
+	while (v != NULL)
+	{
+		path[n++] = v;
+		v = v->next;
+	}
+	for (k = n - 2; k >= last; k--)
+	{
+		zc = zc - dz;
+		zk = z[path[k]->iy][path[k]->ix];
+		if (zk - zc > depth)
+			depth = zk - zc;
+		if (zk < zc)
+			zc = zk;
+	}
+	if (depth > maxBreachDepth)
+		return 0;
+	zc = z0;
+	for (k = n - 2; k >= last; k--)
+	{
+		zc = zc - dz;
+		zk = z[path[k]->iy][path[k]->ix];
+		if (zk > zc)
+		{
+			z[path[k]->iy][path[k]->ix] = zc;
+			markTouched(path[k]->iy, path[k]->ix);
+		}
+		else
+			zc = zk;
+	}
+	return 1;
+}
+
+//ڳʱΪ䣬ֻ̧߲пϰȴӳ·ݵصÿdz
+//·ϵڴֵĸ̧ߵݵ߳zRimĸٴ·ÿԶһdz
+void fillDepression(pVertex* v)
+{
+	int n = 0, head = 0, d, x, y;
+	double zSpill = v->next->zRim, zc;
+	pVertex* u;
+	pVertex* w;
+	//ݸʱڸʼݸ޸
+	if (z[v->iy][v->ix] == nodata)
+		v = v->next;
+	zc = z[v->iy][v->ix];
+	for (u = v->next; u != NULL; u = u->next)
+	{
+		zc = zc + dz;
+		if (z[u->iy][u->ix] < zc)
+		{
+			z[u->iy][u->ix] = zc;
+			markTouched(u->iy, u->ix);
+		}
+		else
+			zc = z[u->iy][u->ix];
+		if (u->zRim < zSpill || u->next == NULL)
+		{
+			u->qi = onFill;
+			path[n++] = u;
+		}
+	}
+	while (head < n)
+	{
+		w = path[head++];
+		for (d = 0; d <= 7; d++)
+		{
+			x = w->ix + ofs[d].ox;
+			y = w->iy + ofs[d].oy;
+			u = adj[y][x];
+			if (u != NULL && u->qi == onTree && u->zRim < zSpill)
+			{
+				z[y][x] = z[w->iy][w->ix] + dz;
+				markTouched(y, x);
+				u->qi = onFill;
+				path[n++] = u;
+			}
+		}
+	}
 }
 
 void pqSearch(int y, int x)
 {
 	pVertex* v = NULL;
+	pVertex* out = NULL;
 	double z0 = 0.0;
 	//bool checkOutlet = false;
 	while (pointIsPit(y, x, z) == 1)
 	{
 		//checkOutlet = false;
 		z0 = z[y][x];
-		pq[1] = (pVertex*)malloc(sizeof(pVertex));
-		adj[y][x] = pq[1];
+		v = &arena[1];
+		adj[y][x] = v;
 		nVertex = 1;
-		pq[1]->ix = x;
-		pq[1]->iy = y;
-		pq[1]->zG = z0;
-		pq[1]->zRim = z0;
-		pq[1]->hDist = 0.0;
-		pq[1]->qi = onTree;
-		pq[1]->next = NULL;
+		v->ix = x;
+		v->iy = y;
+		v->zG = z0;
+		v->zRim = z0;
+		v->hDist = 0.0;
+		v->qi = onTree;
+		v->next = NULL;
 		npq = 0;
-		pqUpdate(pq[1]);
-		do
+		out = pqUpdate(v);
+		while (out == NULL && npq != 0)
 		{
 			v = PQremove();
 			if ((v->zG < z0) || v->iy == 0 || v->iy == N + 1 || v->ix == 0 || v->ix == M + 1)
 				break;
-			pqUpdate(v);
-		} while (npq != 0);
+			out = pqUpdate(v);
+		}
+		//ݸʱΪ
+		if (out != NULL)
+			v = out;
 		double slope = 0.0;
-		//	nChan++;
-		slope = (v->zG - z0) / v->hDist;
-		if (slope * ofsDist[0] > -dz)
+		double zOut = z[v->iy][v->ix];
+		if (breachMode == 1 && breachPath(v, z0) == 1)
 		{
-			//	checkOutlet = true;
-			x = v->ix;
-			y = v->iy;
-			slope = (-dz) / ofsDist[0];
-			z[v->iy][v->ix] = z0 + slope * v->hDist;
-
+			nChan++;
+			if (z[v->iy][v->ix] != zOut)
+			{
+				x = v->ix;
+				y = v->iy;
+			}
 		}
-		do
+		else if (breachMode == 1)
 		{
-			v = v->next;
-			z[v->iy][v->ix] = z0 + slope * v->hDist;
-		} while (v->next != NULL);
+			nSink++;
+			fillDepression(v);
+		}
+		else
+		{
+			nSink++;
+			slope = (v->zG - z0) / v->hDist;
+			if (z[v->iy][v->ix] == nodata)
+			{
+				//ݸʱֻС¶½ݸ޸
+				slope = (-dz) / ofsDist[0];
+			}
+			else if (slope * ofsDist[0] > -dz)
+			{
+				//	checkOutlet = true;
+				x = v->ix;
+				y = v->iy;
+				slope = (-dz) / ofsDist[0];
+				z[v->iy][v->ix] = z0 + slope * v->hDist;
+				markTouched(v->iy, v->ix);
+			}
+			do
+			{
+				v = v->next;
+				z[v->iy][v->ix] = z0 + slope * v->hDist;
+				markTouched(v->iy, v->ix);
+			} while (v->next != NULL);
+		}
 		while (nVertex > 0)
 		{
-			v = pq[nVertex];
+			v = &arena[nVertex];
 			adj[v->iy][v->ix] = NULL;
-			free(v);
 			nVertex--;
 		}
 	}
 }
 
-void sortDownHeap(double** zi, int k, int high)
+void sortDownHeap(pHeapNode* zi, int k, int high)
 {
-	int j;
-	double* temp = zi[k];
-	while (k <= high / 2)
-	{
-		j = k + k;
-		if (j<high && *zi[j]> * zi[j + 1])
-			j++;
-		if (*temp <= *zi[j])
-		{
-			break;
-		}
-		else
-		{
-			zi[k] = zi[j];
-			k = j;
-		}
-	}
-	zi[k] = temp;
+	heapDown(zi, k, high, 0);
 }
 
-void heapSort(double** zi, int ni)
+void heapSort(pHeapNode* zi, int ni)
 {
 	int k;
-	double* temp;
-	for (k = ni / 2; k >= 1; k--)
+	pHeapNode temp;
+	for (k = heapParent(ni); k >= 1; k--)
 		sortDownHeap(zi, k, ni);
 	k = ni;
 	do {
@@ -321,37 +544,62 @@ void heapSort(double** zi, int ni)
 	ni = k;
 }
 
-void fixinvalidpits(double** zi)
+void fixinvalidpits(pHeapNode* zi)
 {
 	int i = 0, x = 0, y = 0;
-	int j;
-	heapSort(zi, ni);
+	int j, start;
+	if (resumePit >= 0)
+	{
+		//ӼָݵѾź򣬴ϴͣµλü
+		start = resumePit;
+		resumePit = -1;
+	}
+	else
+	{
+		if (ni == 0)
+			return;
+		heapSort(zi, ni);
+		if (ckpt != NULL)
+			writePassStart();
+		start = ni;
+	}
 
 
-	for (i = ni; i >= 1; i--)
+	for (i = start; i >= 1; i--)
 	{
-		j = (((int)zi[i]) - ((int)&z[0][0])) / 8;
+		j = zi[i].vi;
 		x = j % (M + 2);
 		y = j / (M + 2);
 		if (pointIsPit(y, x, z) == 1)
 		{
 			pqSearch(y, x);
 		}
+		if (ckpt != NULL && difftime(time(NULL), lastCheckpoint) >= checkpointInterval)
+			writeProgress(i - 1);
 	}
+	if (ckpt != NULL)
+		writeProgress(0);
+}
+
+void addPit(int y, int x)
+{
+	ni++;
+	zi[ni].zRim = z[y][x];
+	zi[ni].zG = z[y][x];
+	zi[ni].hDist = 0.0;
+	zi[ni].vi = y * (M + 2) + x;
 }
 
 void scanGrid()
 {
-	int x, y, k = 0;
-	double* t;
+	int x, y;
 	for (y = 1; y <= N; y++)
 	{
 		for (x = 1; x <= M; x++)
 		{
 			if (pointIsPit(y, x, z) == 1)
 			{
-				ni++;
-				zi[ni] = &z[y][x];
+				addPit(y, x);
 			}
 		}
 	}
@@ -359,11 +607,12 @@ void scanGrid()
 
 void getMemory()
 {
-	int i, x, y;
+	int x, y;
 	int maxVertices = (M + 2) * (N + 2);
-	for (i = 1; i < maxVertices; i++)
+	if (arena == NULL)
 	{
-		pq[i] = NULL;
+		arena = (pVertex*)malloc(sizeof(pVertex) * (maxVertices + 1));
+		path = (pVertex**)malloc(sizeof(pVertex*) * (maxVertices + 1));
 	}
 	for (y = 0; y <= N + 1; y++)
 	{
@@ -401,26 +650,189 @@ void print()
 	fclose(out);
 }
 
-int pfs()
+void setCheckpoint(char* file, double seconds, int resume)
+{
+	checkpointFile = file;
+	checkpointInterval = seconds;
+	resumeMode = resume;
+}
+
+void writePassStart()
+{
+	int end = CKPT_END;
+	fputc('S', ckpt);
+	fwrite(&pass, sizeof(int), 1, ckpt);
+	fwrite(&ni, sizeof(int), 1, ckpt);
+	fwrite(&zi[1], sizeof(pHeapNode), ni, ckpt);
+	fwrite(&end, sizeof(int), 1, ckpt);
+	fflush(ckpt);
+}
+
+void writeProgress(int next)
+{
+	int i, end = CKPT_END;
+	fputc('P', ckpt);
+	fwrite(&next, sizeof(int), 1, ckpt);
+	fwrite(&nChan, sizeof(int), 1, ckpt);
+	fwrite(&nSink, sizeof(int), 1, ckpt);
+	fwrite(&nDirty, sizeof(int), 1, ckpt);
+	fwrite(dirtyList, sizeof(int), nDirty, ckpt);
+	for (i = 0; i < nDirty; i++)
+	{
+		fwrite(&z[0][dirtyList[i]], sizeof(double), 1, ckpt);
+		dirtyFlag[dirtyList[i]] = 0;
+	}
+	fwrite(&end, sizeof(int), 1, ckpt);
+	fflush(ckpt);
+	nDirty = 0;
+	lastCheckpoint = time(NULL);
+}
+
+//־ֱһ¼ָ̡߳ǰݵرһݵأ
+//ĶĸΪ࣬д־ʱһдǷĳһ״̬
+int loadCheckpoint()
+{
+	FILE* in;
+	char magic[8];
+	int m, n, k, cnt, end, type, i, loaded = 0;
+	int* vi;
+	double* val;
+	if ((in = fopen(checkpointFile, "rb")) == NULL)
+		return 0;
+	if (fread(magic, 1, 8, in) != 8 || memcmp(magic, "PFSCKPT1", 8) != 0
+		|| fread(&m, sizeof(int), 1, in) != 1 || fread(&n, sizeof(int), 1, in) != 1 || m != M || n != N)
+	{
+		printf("%s뵱ǰDEM¿ʼ\n", checkpointFile);
+		fclose(in);
+		return 0;
+	}
+	vi = (int*)malloc(sizeof(int) * (M + 2) * (N + 2));
+	val = (double*)malloc(sizeof(double) * (M + 2) * (N + 2));
+	while ((type = fgetc(in)) != EOF)
+	{
+		if (type == 'S')
+		{
+			if (fread(&k, sizeof(int), 1, in) != 1 || fread(&cnt, sizeof(int), 1, in) != 1 || cnt < 0 || cnt > (M + 2) * (N + 2)
+				|| fread(&zi[1], sizeof(pHeapNode), cnt, in) != (size_t)cnt
+				|| fread(&end, sizeof(int), 1, in) != 1 || end != CKPT_END)
+				break;
+			pass = k;
+			ni = cnt;
+			resumePit = cnt;
+			nChan = 0;
+			nSink = 0;
+			loaded = 1;
+		}
+		else if (type == 'P' && loaded)
+		{
+			int next, chan, sink;
+			if (fread(&next, sizeof(int), 1, in) != 1 || fread(&chan, sizeof(int), 1, in) != 1
+				|| fread(&sink, sizeof(int), 1, in) != 1 || fread(&cnt, sizeof(int), 1, in) != 1 || cnt < 0 || cnt > (M + 2) * (N + 2)
+				|| fread(vi, sizeof(int), cnt, in) != (size_t)cnt || fread(val, sizeof(double), cnt, in) != (size_t)cnt
+				|| fread(&end, sizeof(int), 1, in) != 1 || end != CKPT_END)
+				break;
+			for (i = 0; i < cnt; i++)
+			{
+				z[0][vi[i]] = val[i];
+				markTouched(vi[i] / (M + 2), vi[i] % (M + 2));
+			}
+			resumePit = next;
+			nChan = chan;
+			nSink = sink;
+		}
+		else
+			break;
+	}
+	free(vi);
+	free(val);
+	fclose(in);
+	return loaded;
+}
+
+//򿪼־ָʱȶ־ٰѶ״̬ѹһSһP¼д
+//ждһļ¼Ҳһ𶪵
+void startCheckpoint()
+{
+	int loaded;
+	dirtyFlag = (char*)calloc((M + 2) * (N + 2), 1);
+	dirtyList = (int*)malloc(sizeof(int) * (M + 2) * (N + 2));
+	nDirty = 0;
+	loaded = resumeMode ? loadCheckpoint() : 0;
+	if ((ckpt = fopen(checkpointFile, "wb")) == NULL)
+	{
+		printf("޷д%s\n", checkpointFile);
+		exit(0);
+	}
+	fwrite("PFSCKPT1", 1, 8, ckpt);
+	fwrite(&M, sizeof(int), 1, ckpt);
+	fwrite(&N, sizeof(int), 1, ckpt);
+	if (loaded)
+	{
+		int next = resumePit;
+		writePassStart();
+		writeProgress(next);
+		printf("Ӽpass:%d ʣ%dݵ\n", pass, next);
+	}
+	fflush(ckpt);
+	lastCheckpoint = time(NULL);
+}
+
+//DEMݣzСдcloseCheckpointɾ
+void pfsFill()
 {
-	int pass = 0;
 	char* infile = (char *)"../../src/test.txt";
 	readzgrid(infile);
+	if (keepRaw == 1)
+	{
+		raw = (double**)malloc(sizeof(double*) * (N + 2));
+		raw[0] = (double*)malloc((size_t)(M + 2) * (N + 2) * sizeof(double));
+		for (int i = 1; i <= N + 1; i++)
+			raw[i] = raw[i - 1] + M + 2;
+		memcpy(raw[0], z[0], (size_t)(M + 2) * (N + 2) * sizeof(double));
+	}
 	initHorizOffsets();
 	initializeOkPit();
 	getMemory();
+	if (checkpointFile != NULL)
+		startCheckpoint();
 	do
 	{
-		pass++;
-		nChan = 0;
-		nSink = 0;
-		ni = 0;
-		scanGrid();
-		printf("pass:%d ҵ%dݵ\n", pass, ni);
+		if (resumePit < 0)
+		{
+			pass++;
+			nChan = 0;
+			nSink = 0;
+			ni = 0;
+			scanGrid();
+			printf("pass:%d ҵ%dݵ\n", pass, ni);
+		}
 		fixinvalidpits(zi);
+		if (breachMode == 1)
+			printf("pass:%d %d%d\n", pass, nChan, nSink);
 	} while (ni != 0);
-	free(zi);
+	bigFree(zi, sizeof(pHeapNode) * ((M + 2) * (N + 2) + 1));
+	zi = NULL;
+}
+
+void closeCheckpoint()
+{
+	if (ckpt != NULL)
+	{
+		//ɣ㲻Ҫ
+		fclose(ckpt);
+		ckpt = NULL;
+		remove(checkpointFile);
+		free(dirtyFlag);
+		free(dirtyList);
+		dirtyFlag = NULL;
+	}
+}
+
+int pfs()
+{
+	pfsFill();
 	print();
+	closeCheckpoint();
 	printf("finished!\n");
 
 	return 0;
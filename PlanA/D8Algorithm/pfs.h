@@ -4,6 +4,11 @@
 #include<malloc.h>
 #include<math.h>
 #include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#ifdef __linux__
+#include<sys/mman.h>
+#endif
 #include <iostream>
 
 using namespace std;
@@ -15,6 +20,25 @@ typedef struct tVertex {
 	struct tVertex* next;
 }pVertex;
 
+//ѽڵ㣺õļֵ붥ŷһ𣬱Ƚʱ÷ʶ
+//ݵʱviΪԪzе±
+typedef struct tHeapNode {
+	double zRim, zG, hDist;
+	int vi;
+}pHeapNode;
+
+#define HEAP_D 4
+#define heapParent(k) (((k) + HEAP_D - 2) / HEAP_D)
+#define heapChild(k) (HEAP_D * ((k) - 1) + 2)
+
+extern double** z;
+extern pHeapNode* zi;
+extern int M, N, ni;
+extern int nodata;
+extern double dx;//߳
+extern double** raw;//δݵDEMzͬsetKeepRaw
+extern int touchY0, touchX0, touchY1, touchX1;
+
 void readzgrid(char infile[]);
 
 void initHorizOffsets();
@@ -25,32 +49,76 @@ void printpit(int y, int x, FILE* out);
 
 int pointIsPit(int y, int x, double** z);
 
-bool higherPriority(pVertex* v1, pVertex* v2);
+bool higherPriority(pHeapNode* v1, pHeapNode* v2);
+
+void heapUp(pHeapNode* h, int k, int track);
+
+void heapDown(pHeapNode* h, int k, int n, int track);
 
 void upHeap(int k);
 
 void downHeap(int k);
 
+pVertex* newVertex(pVertex* vOnTree, int x, int y, int d);
+
 void PQinsert(pVertex* vOnTree, int x, int y, int d);
 
 pVertex* PQremove();
 
-void pqUpdate(pVertex* vOnTree);
+pVertex* pqUpdate(pVertex* vOnTree);
+
+void resetTouched();
+
+void markTouched(int y, int x);
+
+//ģʽȲdepthȲlengthʱС·ڣݵ䵽߳
+void setBreaching(double depth, double length);
+
+int breachPath(pVertex* v, double z0);
+
+void fillDepression(pVertex* v);
 
 void pqSearch(int y, int x);
 
-void sortDownHeap(double** zi, int k, int high);
+void sortDownHeap(pHeapNode* zi, int k, int high);
 
-void heapSort(double** zi, int ni);//С
+void heapSort(pHeapNode* zi, int ni);//С
 
-void fixinvalidpits(double** zi);
+void fixinvalidpits(pHeapNode* zi);
+
+void addPit(int y, int x);
 
 void scanGrid();
 
 
+//㣺ÿsecondsݽ׷дfileresumeΪ1ʱȴfileָ
+void setCheckpoint(char* file, double seconds, int resume);
+
+void writePassStart();
+
+void writeProgress(int next);
+
+int loadCheckpoint();
+
+void startCheckpoint();
+
+void closeCheckpoint();
+
+//ҳonΪ1ʱһ͸ҳpfs()֮ǰ
+void setHugePages(int on);
+
+void* bigAlloc(size_t size);
+
+//ԭʼDEMonΪ1ʱpfsFillǰzƵrawpfsFill֮ǰ
+void setKeepRaw(int on);
+
+void bigFree(void* p, size_t size);
+
 void getMemory();
 
 void print();
 
 
+void pfsFill();
+
 int pfs();
\ No newline at end of file
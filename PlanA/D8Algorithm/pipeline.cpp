@@ -0,0 +1,60 @@
+#include "pipeline.h"
+
+int pipeline(int dumpFilled, int terrain, const DirtyRect* edit, double editZ, const RunoffFiles& files)
+{
+	if (edit != NULL)
+		setKeepRaw(1);
+	pfsFill();
+	if (edit != NULL && (edit->y0 < 1 || edit->x0 < 1 || edit->y1 > N || edit->x1 > M || edit->y0 > edit->y1 || edit->x0 > edit->x1))
+	{
+		printf("编辑范围超出格网%d×%d\n", N, M);
+		return 1;
+	}
+
+	//D8通过FilledGrid直接读z，不复制格网
+	FilledGrid grid = { z };
+	vector<vector<int>> Vector(N, vector<int>(M, 0));
+	vector<vector<int>> Result(N, vector<int>(M, 0));
+	//地形因子与流向在同一遍扫描中算出，TWI在汇流中算出
+	Terrain surface;
+	if (terrain == 1)
+	{
+		surface.cellsize = dx;
+		surface.nodata = nodata;
+		surface.resize(N, M);
+	}
+	D8_direction(grid, N, M, Vector, 0, N - 1, 0, M - 1, nodata, terrain == 1 ? &surface : NULL);
+	//按拓扑顺序汇流，每个像元只处理一次
+	D8_accumulation(Vector, Result, UnitWeight(), terrain == 1 ? &surface : NULL);
+	if (edit != NULL)
+	{
+		//把编辑写入原始DEM，只在受影响的范围内重新填洼、算流向，并沿下游路径改汇流
+		closeCheckpoint();
+		for (int y = edit->y0; y <= edit->y1; y++)
+			for (int x = edit->x0; x <= edit->x1; x++)
+				raw[y][x] = editZ;
+		DirtyRect box = incrementalUpdate(raw, *edit, Vector, Result);
+		printf("增量更新：重算第%d-%d行、第%d-%d列的流向\n", box.y0 - 1, box.y1 - 1, box.x0 - 1, box.x1 - 1);
+	}
+	if (files.rainfall != NULL)
+	{
+		vector<vector<double>> rainfall, runoff, loss;
+		if (!D8_readGrid(files.rainfall, N, M, rainfall)
+			|| (files.runoff != NULL && !D8_readGrid(files.runoff, N, M, runoff))
+			|| (files.loss != NULL && !D8_readGrid(files.loss, N, M, loss)))
+			return 1;
+		RunoffWeight weight = { &rainfall, files.runoff != NULL ? &runoff : NULL, files.loss != NULL ? &loss : NULL };
+		vector<vector<double>> flow(N, vector<double>(M, 0));
+		D8_accumulation(Vector, flow, weight);
+		D8_writeGrid("./runoff.txt", flow);
+	}
+	if (dumpFilled == 1)
+		print();
+	D8_write(Vector, Result);
+	if (terrain == 1)
+		D8_writeTerrain(surface);
+
+	closeCheckpoint();
+	printf("finished!\n");
+	return 0;
+}
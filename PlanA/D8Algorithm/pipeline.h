@@ -0,0 +1,16 @@
+#pragma once
+#include "incremental.h"
+
+//加权汇流的输入格网，与test.txt格式相同；rainfall为NULL时不做加权汇流，runoff、loss可以为NULL
+struct RunoffFiles {
+    const char* rainfall = NULL;
+    const char* runoff = NULL;
+    const char* loss = NULL;
+};
+
+//读入DEM→填洼→D8流向→汇流→写出direction.txt、river.txt，填洼后的z直接交给D8，
+//不经过Gridout.txt。dumpFilled为1时另外写出填洼结果Gridout.txt，
+//terrain为1时另外写出坡度、坡向、曲率和TWI（见Terrain）。
+//edit不为NULL时，先算出原DEM的结果，再把edit范围内的高程改为editZ并增量更新（见incrementalUpdate）。
+//给出降雨格网时另外按降雨×径流系数加权汇流，写到runoff.txt（见RunoffWeight）
+int pipeline(int dumpFilled, int terrain, const DirtyRect* edit = NULL, double editZ = 0, const RunoffFiles& files = RunoffFiles());
@@ -0,0 +1,123 @@
+#pragma once
+#include <deque>
+#include <cmath>
+#include <type_traits>
+
+#include "raster.h"
+
+
+// Weight source giving every cell a weight of one, accumulation is then a cell count
+struct UnitWeight {
+    static const bool lossy = false;
+
+    double operator()(int, int) const { return 1; }
+
+    double retained(int, int) const { return 1; }
+};
+
+// Weight source of rainfall x runoff coefficient per cell, with an optional loss fraction
+// applied to everything leaving the cell (infiltration, evaporation, abstraction)
+struct RunoffWeight {
+    static const bool lossy = true;
+    const Raster<float>* rainfall; // rainfall depth or volume per cell
+    const Raster<float>* runoff; // runoff coefficient, NULL for 1
+    const Raster<float>* loss; // fraction lost in the cell, NULL for none
+
+    RunoffWeight(const Raster<float>* rainfall, const Raster<float>* runoff, const Raster<float>* loss) {
+        this->rainfall = rainfall;
+        this->runoff = runoff;
+        this->loss = loss;
+    }
+
+    double operator()(int x, int y) const {
+        double w = (*rainfall)(x, y);
+        if (runoff != NULL)
+            w *= (*runoff)(x, y);
+        return w;
+    }
+
+    double retained(int x, int y) const {
+        return loss == NULL ? 1.0 : 1.0 - (*loss)(x, y);
+    }
+};
+
+// Add value to an accumulation cell. Integer counts are added directly, floating point
+// values use Neumaier compensated summation with the running error kept in carry, so the
+// result does not depend on how large the upstream totals are compared to a single cell
+template <typename T, bool compensated = std::is_floating_point<T>::value>
+struct AccumulationSum {
+    static void add(T& sum, T& carry, T value) {
+        sum += value;
+    }
+
+    static T total(T sum, T carry) {
+        return sum;
+    }
+};
+
+template <typename T>
+struct AccumulationSum<T, true> {
+    static void add(T& sum, T& carry, T value) {
+        T t = sum + value;
+        if (std::fabs(sum) >= std::fabs(value))
+            carry += (sum - t) + value;
+        else
+            carry += (value - t) + sum;
+        sum = t;
+    }
+
+    static T total(T sum, T carry) {
+        return sum + carry;
+    }
+};
+
+// Calculate flow accumulation from the flow direction raster. cells_to_process_accumulation
+// holds the cells in the order they left the flood queue, so walking it backwards visits every
+// cell after all of its upstream cells. Each cell passes (its accumulation + its weight) x the
+// retained fraction to the cell it drains to. The order is fixed by the flood, which keeps
+// floating point results reproducible run to run. Outlets are set to zero unless zero_outlets
+// is false, they then keep the water that reaches them (used to pass it on to other tiles).
+template <typename T, typename Weight, typename DirStore, typename AccStore>
+void accumulate_flow(const std::deque<CellPosition>& cells_to_process_accumulation, const Raster<unsigned int, DirStore>& flow_direction,
+    Raster<T, AccStore>& flow_accumulation, const Weight& weight, bool zero_outlets = true) {
+    typedef AccumulationSum<T> Sum;
+    constexpr bool compensated = std::is_floating_point<T>::value;
+    Raster<T> carry(compensated ? flow_accumulation.max_x : 0, compensated ? flow_accumulation.max_y : 0);
+    carry.set_layout(flow_accumulation.tile_shift);
+    carry.fill();
+
+    for (auto cell = cells_to_process_accumulation.rbegin(); cell != cells_to_process_accumulation.rend(); ++cell)
+    {
+        int x = cell->x;
+        int y = cell->y;
+        int dir = flow_direction(x, y);
+        int down_x = x, down_y = y;
+        if (!flow_target(dir, down_x, down_y))
+        {
+            // outlets keep the original convention of an accumulation of zero
+            if (zero_outlets) {
+                flow_accumulation(x, y) = 0;
+                if constexpr (compensated)
+                    carry(x, y) = 0;
+            }
+            continue;
+        }
+        T outflow;
+        if constexpr (compensated)
+            outflow = Sum::total(flow_accumulation(x, y), carry(x, y)) + (T)weight(x, y);
+        else
+            outflow = flow_accumulation(x, y) + (T)weight(x, y);
+        if (Weight::lossy)
+            outflow = (T)(outflow * weight.retained(x, y));
+        if constexpr (compensated)
+            Sum::add(flow_accumulation(down_x, down_y), carry(down_x, down_y), outflow);
+        else
+            flow_accumulation(down_x, down_y) += outflow;
+    }
+
+    if constexpr (compensated)
+    {
+        for (size_t i = 0; i < flow_accumulation.pixels.size(); ++i)
+            flow_accumulation.pixels[i] = Sum::total(flow_accumulation.pixels[i], carry.pixels[i]);
+    }
+}
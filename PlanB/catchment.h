@@ -0,0 +1,149 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <deque>
+#include <iostream>
+#include <algorithm>
+
+#include "raster.h"
+#include "parallel.h"
+#include "cellsize.h"
+#include "flowlength.h"
+
+
+// Statistics of the catchment of every outlet
+//
+// A catchment is the set of cells draining to one outlet, a cell whose direction leaves the
+// DEM or ends at nodata. The flood order has every cell after the cell it drains to, so the
+// walk of distances_to_outlet (flowlength.h) labels each cell with the catchment of its
+// downstream cell as it hands the distance to the outlet upstream, adding up cell counts, areas
+// and the longest flow path as it goes. Mean elevation and slope need the 3x3 window of every
+// cell instead of the order: the rows are split into bands of CATCHMENT_BAND_ROWS, each summed
+// per catchment it touches on its own, then added up band by band. The bands do not depend on
+// the thread count, so neither do the sums, and a band only keeps the catchments it touches.
+
+const uint32_t NO_CATCHMENT = UINT32_MAX; // cells that were not flooded (nodata)
+const int CATCHMENT_BAND_ROWS = 64;
+
+// Elevation and slope sums of one catchment in a band of rows
+struct CatchmentSums {
+    uint32_t catchment;
+    double elevation, slope;
+};
+
+struct Catchment {
+    int outlet_x = 0, outlet_y = 0;
+    uint64_t cells = 0; // cells draining to the outlet, itself included
+    double area = 0; // in the units of the CellSizes
+    double elevation = 0; // mean elevation of the cells
+    double slope = 0; // mean slope of the cells, degrees
+    double flow_length = 0; // longest flow path down to the outlet
+};
+
+// Horn slope in degrees of (x, y), cells outside the DEM or in mask take the elevation of (x, y)
+template <typename Z>
+double cell_slope(const Raster<Z>& input_raster, const NodataMask* mask, const CellSizes& sizes, int x, int y) {
+    double e = input_raster(x, y);
+    auto at = [&](int nx, int ny) {
+        return nx < 0 || ny < 0 || nx >= input_raster.max_x || ny >= input_raster.max_y || is_masked(mask, nx, ny)
+            ? e : (double)input_raster(nx, ny);
+    };
+    double a = at(x - 1, y - 1), b = at(x, y - 1), c = at(x + 1, y - 1);
+    double d = at(x - 1, y), f = at(x + 1, y);
+    double g = at(x - 1, y + 1), h = at(x, y + 1), k = at(x + 1, y + 1);
+    double dzdx = ((c + 2 * f + k) - (a + 2 * d + g)) / (8 * sizes.width[y]);
+    double dzdy = ((g + 2 * h + k) - (a + 2 * b + c)) / (8 * sizes.height[y]);
+    return std::atan(std::sqrt(dzdx * dzdx + dzdy * dzdy)) / RADIANS_PER_DEGREE;
+}
+
+// Statistics of the catchments of a flooded DEM, in the order their outlets come in the flood
+// order. to_outlet is set to the distance to the outlet of every cell on the way, as by
+// distances_to_outlet. threads workers (serial with 1) sum the elevations and slopes.
+template <typename Z, typename DirStore>
+void catchment_statistics(const Raster<Z>& input_raster, const std::deque<CellPosition>& cells_to_process_accumulation,
+    const Raster<unsigned int, DirStore>& flow_direction, const NodataMask* mask, const CellSizes& sizes, int threads,
+    Raster<double>& to_outlet, std::vector<Catchment>& catchments) {
+    int max_x = flow_direction.max_x, max_y = flow_direction.max_y;
+    catchments.clear();
+    std::vector<uint32_t> label((size_t)max_x * max_y, NO_CATCHMENT);
+    distances_to_outlet(cells_to_process_accumulation, flow_direction, sizes, to_outlet, [&](const CellPosition& cell, int down_x, int down_y) {
+        uint32_t& c = label[flow_direction.cell_id(cell.x, cell.y)];
+        if (down_x >= 0) {
+            c = label[flow_direction.cell_id(down_x, down_y)];
+        }
+        else {
+            c = (uint32_t)catchments.size();
+            catchments.emplace_back();
+            catchments.back().outlet_x = cell.x;
+            catchments.back().outlet_y = cell.y;
+        }
+        Catchment& catchment = catchments[c];
+        catchment.cells += 1;
+        catchment.area += sizes.area(cell.y);
+        catchment.flow_length = std::max(catchment.flow_length, (double)to_outlet(cell.x, cell.y));
+    });
+
+    // elevation and slope sums of every band of rows: the cells by catchment (stable, so in
+    // row order), then one entry per catchment
+    int bands = (max_y + CATCHMENT_BAND_ROWS - 1) / CATCHMENT_BAND_ROWS;
+    std::vector<std::vector<CatchmentSums> > sums(bands);
+    parallel_for(bands, std::max(1, threads), [&](int band) {
+        std::vector<CatchmentSums>& band_sums = sums[band];
+        for (int y = band * CATCHMENT_BAND_ROWS; y < std::min(max_y, (band + 1) * CATCHMENT_BAND_ROWS); ++y) {
+            for (int x = 0; x < max_x; ++x) {
+                uint32_t c = label[flow_direction.cell_id(x, y)];
+                if (c == NO_CATCHMENT)
+                    continue;
+                CatchmentSums cell = { c, (double)input_raster(x, y), cell_slope(input_raster, mask, sizes, x, y) };
+                band_sums.push_back(cell);
+            }
+        }
+        std::stable_sort(band_sums.begin(), band_sums.end(),
+            [](const CatchmentSums& a, const CatchmentSums& b) { return a.catchment < b.catchment; });
+        size_t kept = 0;
+        for (size_t i = 0; i < band_sums.size(); ++i) {
+            if (kept > 0 && band_sums[kept - 1].catchment == band_sums[i].catchment) {
+                band_sums[kept - 1].elevation += band_sums[i].elevation;
+                band_sums[kept - 1].slope += band_sums[i].slope;
+            }
+            else {
+                band_sums[kept++] = band_sums[i];
+            }
+        }
+        band_sums.resize(kept);
+        band_sums.shrink_to_fit();
+    });
+    for (int band = 0; band < bands; ++band) {
+        for (size_t i = 0; i < sums[band].size(); ++i) {
+            Catchment& catchment = catchments[sums[band][i].catchment];
+            catchment.elevation += sums[band][i].elevation;
+            catchment.slope += sums[band][i].slope;
+        }
+    }
+    for (size_t c = 0; c < catchments.size(); ++c) {
+        catchments[c].elevation /= catchments[c].cells;
+        catchments[c].slope /= catchments[c].cells;
+    }
+}
+
+// Write the catchments to a CSV file, one row each with its outlet
+inline bool write_catchments(const std::string& filename, const std::vector<Catchment>& catchments) {
+    FILE* file = fopen(filename.c_str(), "w");
+    if (file == NULL) {
+        std::cerr << "Couldn't write " << filename << std::endl;
+        return false;
+    }
+    fprintf(file, "id,outlet_x,outlet_y,cells,area,mean_elevation,mean_slope,max_flow_length\n");
+    for (size_t c = 0; c < catchments.size(); ++c) {
+        const Catchment& catchment = catchments[c];
+        fprintf(file, "%zu,%d,%d,%llu,%.10g,%.10g,%.10g,%.10g\n", c, catchment.outlet_x, catchment.outlet_y,
+            (unsigned long long)catchment.cells, catchment.area, catchment.elevation, catchment.slope, catchment.flow_length);
+    }
+    bool ok = fclose(file) == 0;
+    if (!ok)
+        std::cerr << "Couldn't write " << filename << std::endl;
+    return ok;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+
+#include "raster.h"
+
+
+// Length of a step from a cell to each of its eight neighbours, per row
+//
+// In a projected DEM every row has the same cell size, the pixel size of the geotransform. In
+// a geographic DEM (degrees, like the SRTM tiles) a cell narrows towards the poles, so the
+// sizes of every row are worked out on the WGS-84 ellipsoid at the latitude of the row: the
+// width from the radius of the parallel, the height from the radius of curvature of the
+// meridian. A step between two rows takes the mean size of both. The lengths are looked up by
+// row and direction code, so a pass over the cells does no trigonometry.
+
+const double WGS84_A = 6378137.0; // semi-major axis, metres
+const double WGS84_E2 = 6.69437999014e-3; // first eccentricity squared
+const double RADIANS_PER_DEGREE = 3.14159265358979323846 / 180;
+
+struct CellSizes {
+    int max_y = 0;
+    std::vector<double> width, height; // of the cells of every row
+    std::vector<double> steps; // 8 per row: the length of the step of direction code 10 * (k + 1)
+
+    // Sizes of the rows of a max_y rows raster with the geotransform transform. geographic:
+    // the transform is in degrees of latitude and longitude on WGS-84
+    void set(const double transform[6], int max_y, bool geographic) {
+        this->max_y = max_y;
+        width.assign(max_y, 0);
+        height.assign(max_y, 0);
+        for (int y = 0; y < max_y; ++y) {
+            if (!geographic) {
+                width[y] = std::fabs(transform[1]);
+                height[y] = std::fabs(transform[5]);
+                continue;
+            }
+            double latitude = (transform[3] + (y + 0.5) * transform[5]) * RADIANS_PER_DEGREE;
+            double s = std::sin(latitude);
+            double w = 1 - WGS84_E2 * s * s;
+            double normal = WGS84_A / std::sqrt(w); // prime vertical radius
+            double meridian = WGS84_A * (1 - WGS84_E2) / (w * std::sqrt(w));
+            width[y] = normal * std::cos(latitude) * std::fabs(transform[1]) * RADIANS_PER_DEGREE;
+            height[y] = meridian * std::fabs(transform[5]) * RADIANS_PER_DEGREE;
+        }
+        steps.assign((size_t)max_y * 8, 0);
+        for (int y = 0; y < max_y; ++y) {
+            for (int k = 0; k < 8; ++k) {
+                int x1 = 0, y1 = y;
+                flow_target(10 * (k + 1), x1, y1);
+                int row = std::min(std::max(y1, 0), max_y - 1);
+                double w = (width[y] + width[row]) / 2, h = (height[y] + height[row]) / 2;
+                steps[(size_t)y * 8 + k] = x1 == 0 ? h : y1 == y ? w : std::sqrt(w * w + h * h);
+            }
+        }
+    }
+
+    // Length of the step from a cell of row y along direction code dir (10 to 80)
+    double step(int y, int dir) const {
+        return steps[(size_t)y * 8 + dir / 10 - 1];
+    }
+
+    // Area of a cell of row y
+    double area(int y) const {
+        return width[y] * height[y];
+    }
+};
+
+// Does a projection in WKT describe geographic coordinates (no projection)
+inline bool is_geographic(const std::string& projection) {
+    return projection.compare(0, 6, "GEOGCS") == 0 || projection.compare(0, 7, "GEOGCRS") == 0;
+}
@@ -0,0 +1,292 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <filesystem>
+
+#include "raster.h"
+
+
+// Checkpoints of the serial flood
+//
+// The flood appends a segment to the checkpoint file every interval seconds: the cells that
+// left the queue since the previous segment with their directions, then the cells in the queue
+// and the next insertion order. A cell leaves the queue once, so a segment only costs the work
+// done since the last one plus the queue, which is a thin front through the DEM. The state at a
+// segment is every cell of the segments so far with its direction, in the order they left the
+// queue, plus the queue of that segment. A segment counts once its end marker is written; a
+// segment cut off by a crash is dropped from the file when the flood is resumed. The queues of
+// the earlier segments are not needed any more, so once they take more of the file than the
+// cells do, and whenever the flood is resumed, the file is rewritten (next to it, then renamed
+// over it) as one segment of every cell so far and the current queue.
+
+const char CHECKPOINT_MAGIC[8] = { 'P', 'B', 'F', 'L', 'O', 'O', 'D', '1' };
+const uint32_t SEGMENT_END = 0x444E4521;
+
+// Header of a checkpoint file, a checkpoint is only resumed for the DEM it was written for
+struct CheckpointHeader {
+    char magic[8];
+    int32_t max_x, max_y;
+    uint32_t elevation_size; // bytes per elevation
+    uint64_t checksum; // of the elevations
+};
+
+// Cell of the queue in a segment, its elevation is read from the DEM again
+struct CheckpointEntry {
+    uint64_t insertion_order;
+    int32_t x, y;
+    uint32_t dir;
+};
+
+// Checksum of the elevations, cell by cell in rows, so the padding of the tiled layout (left
+// unset by the reader) is not part of it and the layout does not change it
+template <typename Z>
+uint64_t elevation_checksum(const Raster<Z>& input_raster) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (int y = 0; y < input_raster.max_y; ++y) {
+        for (int x = 0; x < input_raster.max_x; ++x) {
+            Z value = input_raster(x, y);
+            uint64_t word = 0;
+            memcpy(&word, &value, sizeof(Z));
+            hash = (hash ^ word) * 1099511628211ULL;
+            hash ^= hash >> 29;
+        }
+    }
+    return hash;
+}
+
+struct FloodCheckpoint {
+    std::string filename;
+    double interval = 300; // seconds between segments
+    FILE* file = NULL;
+    CheckpointHeader header;
+    uint64_t cell_bytes = 0; // of the cells in the file
+    uint64_t stale_bytes = 0; // of the queues of the segments before the last one
+    uint64_t queue_bytes = 0; // of the queue of the last segment
+    std::vector<uint64_t> popped; // cells that left the queue since the last segment
+    std::vector<uint8_t> popped_dir; // their directions / 10
+    std::chrono::steady_clock::time_point last;
+
+    // state of the last segment, when the flood is resumed
+    bool resumed = false;
+    std::vector<RasterCell> queue;
+    uint64_t insert_order = 0;
+
+    ~FloodCheckpoint() {
+        if (file != NULL)
+            fclose(file);
+    }
+
+    // Record a cell leaving the queue
+    void pop(uint64_t cell, int dir) {
+        popped.push_back(cell);
+        popped_dir.push_back((uint8_t)(dir / 10));
+    }
+
+    // Is it time for a segment, looked at every 65536 cells so the clock costs nothing
+    bool due() const {
+        if (file == NULL || (popped.size() & 0xffff) != 0)
+            return false;
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - last).count() >= interval;
+    }
+
+    // Write the end of a segment after its cells: the next insertion order and the queue
+    static bool write_queue(FILE* out, uint64_t next_insert_order, const std::vector<CheckpointEntry>& entries) {
+        uint64_t m = entries.size();
+        return fwrite(&next_insert_order, sizeof(next_insert_order), 1, out) == 1
+            && fwrite(&m, sizeof(m), 1, out) == 1
+            && fwrite(entries.data(), sizeof(CheckpointEntry), m, out) == m
+            && fwrite(&SEGMENT_END, sizeof(SEGMENT_END), 1, out) == 1;
+    }
+
+    // Replace the file by the header and one segment of every cell of done (the cells that left
+    // the queue, in that order) and entries, and open it for the next segments
+    template <typename Store>
+    bool rewrite(const std::deque<CellPosition>& done, const Raster<unsigned int, Store>& flow_direction,
+        uint64_t next_insert_order, const std::vector<CheckpointEntry>& entries) {
+        if (file != NULL)
+            fclose(file);
+        file = NULL;
+        std::string staging = filename + ".tmp";
+        FILE* out = fopen(staging.c_str(), "wb");
+        uint64_t n = done.size();
+        bool ok = out != NULL && fwrite(&header, sizeof(header), 1, out) == 1 && fwrite(&n, sizeof(n), 1, out) == 1;
+        // the cells and then their directions, a block at a time
+        const size_t block = 65536;
+        std::vector<uint64_t> cells;
+        std::vector<uint8_t> dirs;
+        for (size_t i = 0; ok && i < done.size(); i += block) {
+            cells.clear();
+            for (size_t j = i; j < std::min(done.size(), i + block); ++j)
+                cells.push_back(flow_direction.cell_id(done[j].x, done[j].y));
+            ok = fwrite(cells.data(), sizeof(uint64_t), cells.size(), out) == cells.size();
+        }
+        for (size_t i = 0; ok && i < done.size(); i += block) {
+            dirs.clear();
+            for (size_t j = i; j < std::min(done.size(), i + block); ++j)
+                dirs.push_back((uint8_t)(flow_direction(done[j].x, done[j].y) / 10));
+            ok = fwrite(dirs.data(), 1, dirs.size(), out) == dirs.size();
+        }
+        ok = ok && write_queue(out, next_insert_order, entries);
+        if (out != NULL && fclose(out) != 0)
+            ok = false;
+        std::error_code error;
+        if (ok)
+            std::filesystem::rename(staging, filename, error);
+        if (!ok || error) {
+            std::remove(staging.c_str());
+            return false;
+        }
+        file = fopen(filename.c_str(), "ab");
+        cell_bytes = n * (sizeof(uint64_t) + 1);
+        stale_bytes = 0;
+        queue_bytes = entries.size() * sizeof(CheckpointEntry);
+        return file != NULL;
+    }
+
+    // Append a segment with the cells popped since the last one and the cells in queue, or
+    // rewrite the file when the old queues in it outweigh the cells
+    template <typename Queue, typename Store>
+    void write(const Queue& cells_to_process_flow, uint64_t next_insert_order, const std::deque<CellPosition>& done,
+        const Raster<unsigned int, Store>& flow_direction) {
+        if (file == NULL)
+            return;
+        std::vector<CheckpointEntry> entries;
+        cells_to_process_flow.for_each([&](const RasterCell& cell) {
+            CheckpointEntry entry = { cell.insertion_order, cell.x, cell.y, (uint32_t)cell.flow_dir };
+            entries.push_back(entry);
+        });
+        uint64_t n = popped.size();
+        bool ok;
+        if (stale_bytes + queue_bytes > cell_bytes) {
+            ok = rewrite(done, flow_direction, next_insert_order, entries);
+        }
+        else {
+            ok = fwrite(&n, sizeof(n), 1, file) == 1
+                && fwrite(popped.data(), sizeof(uint64_t), n, file) == n
+                && fwrite(popped_dir.data(), 1, n, file) == n
+                && write_queue(file, next_insert_order, entries)
+                && fflush(file) == 0;
+            cell_bytes += n * (sizeof(uint64_t) + 1);
+            stale_bytes += queue_bytes;
+            queue_bytes = entries.size() * sizeof(CheckpointEntry);
+        }
+        if (!ok) {
+            std::cerr << "Couldn't write checkpoint " << filename << ", the flood goes on without" << std::endl;
+            if (file != NULL)
+                fclose(file);
+            file = NULL;
+        }
+        popped.clear();
+        popped_dir.clear();
+        last = std::chrono::steady_clock::now();
+    }
+};
+
+// Open checkpoint.filename for a flood of input_raster. With resume, the last complete segment
+// of an existing file for the same DEM is loaded first: the cells that left the queue get their
+// direction, queued and visited marks and are appended to cells_to_process_accumulation, and
+// the queue and next insertion order are kept in checkpoint for the flood to carry on with.
+// Returns false when the file can't be written, with flow_direction and
+// cells_to_process_accumulation left as they were for a flood from the start.
+template <typename Z, typename Store>
+bool open_checkpoint(FloodCheckpoint& checkpoint, const Raster<Z>& input_raster, bool resume,
+    Raster<unsigned int, Store>& flow_direction, std::deque<CellPosition>& cells_to_process_accumulation) {
+    CheckpointHeader& header = checkpoint.header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.max_x = input_raster.max_x;
+    header.max_y = input_raster.max_y;
+    header.elevation_size = sizeof(Z);
+    header.checksum = elevation_checksum(input_raster);
+
+    FILE* in = resume ? fopen(checkpoint.filename.c_str(), "rb") : NULL;
+    if (in != NULL) {
+        CheckpointHeader found;
+        if (fread(&found, sizeof(found), 1, in) != 1 || memcmp(&found, &header, sizeof(header)) != 0) {
+            std::cout << checkpoint.filename << " is not a checkpoint of this DEM, starting over" << std::endl;
+        }
+        else {
+            int max_x = input_raster.max_x;
+            std::vector<uint64_t> cells;
+            std::vector<uint8_t> dirs;
+            std::vector<CheckpointEntry> entries;
+            while (true) {
+                uint64_t n, m, next_insert_order;
+                uint32_t end;
+                if (fread(&n, sizeof(n), 1, in) != 1 || n > input_raster.pixels.size())
+                    break;
+                cells.resize(n);
+                dirs.resize(n);
+                if (fread(cells.data(), sizeof(uint64_t), n, in) != n || fread(dirs.data(), 1, n, in) != n
+                    || fread(&next_insert_order, sizeof(next_insert_order), 1, in) != 1
+                    || fread(&m, sizeof(m), 1, in) != 1 || m > input_raster.pixels.size())
+                    break;
+                entries.resize(m);
+                if (fread(entries.data(), sizeof(CheckpointEntry), m, in) != m
+                    || fread(&end, sizeof(end), 1, in) != 1 || end != SEGMENT_END)
+                    break;
+                for (uint64_t i = 0; i < n; ++i) {
+                    int x = (int)(cells[i] % max_x), y = (int)(cells[i] / max_x);
+                    flow_direction(x, y) = dirs[i] * 10u;
+                    flow_direction.Add_to_queue(x, y);
+                    flow_direction.Is_Visited(x, y);
+                    cells_to_process_accumulation.push_back(CellPosition(x, y));
+                }
+                checkpoint.queue.clear();
+                for (uint64_t i = 0; i < m; ++i) {
+                    const CheckpointEntry& entry = entries[i];
+                    checkpoint.queue.push_back(RasterCell(entry.x, entry.y, input_raster(entry.x, entry.y), entry.insertion_order, entry.dir));
+                }
+                checkpoint.insert_order = next_insert_order;
+                checkpoint.resumed = true;
+            }
+        }
+        fclose(in);
+    }
+
+    if (checkpoint.resumed) {
+        // the queued cells already have their direction, set when they were queued
+        std::vector<CheckpointEntry> entries;
+        for (size_t i = 0; i < checkpoint.queue.size(); ++i) {
+            const RasterCell& cell = checkpoint.queue[i];
+            flow_direction(cell.x, cell.y) = cell.flow_dir;
+            flow_direction.Add_to_queue(cell.x, cell.y);
+            CheckpointEntry entry = { cell.insertion_order, cell.x, cell.y, (uint32_t)cell.flow_dir };
+            entries.push_back(entry);
+        }
+        // one segment of the state loaded, which also drops a segment cut off half way
+        checkpoint.rewrite(cells_to_process_accumulation, flow_direction, checkpoint.insert_order, entries);
+    }
+    else {
+        checkpoint.file = fopen(checkpoint.filename.c_str(), "wb");
+        if (checkpoint.file != NULL && (fwrite(&header, sizeof(header), 1, checkpoint.file) != 1 || fflush(checkpoint.file) != 0)) {
+            fclose(checkpoint.file);
+            checkpoint.file = NULL;
+        }
+    }
+    if (checkpoint.file == NULL) {
+        std::cerr << "Couldn't write checkpoint " << checkpoint.filename << std::endl;
+        if (checkpoint.resumed) {
+            // the flood starts over without the checkpoint, from nothing loaded
+            flow_direction.fill();
+            flow_direction.fill_visit();
+            cells_to_process_accumulation.clear();
+            checkpoint.queue.clear();
+            checkpoint.insert_order = 0;
+            checkpoint.resumed = false;
+        }
+        return false;
+    }
+    if (checkpoint.resumed)
+        std::cout << "Resuming the flood from " << checkpoint.filename << " with " << cells_to_process_accumulation.size()
+            << " cells done and " << checkpoint.queue.size() << " in the queue" << std::endl;
+    checkpoint.last = std::chrono::steady_clock::now();
+    return true;
+}
@@ -0,0 +1,595 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <iostream>
+
+#include "raster.h"
+#include "queue.h"
+#include "flood.h"
+
+
+// Depression hierarchy and fill-spill-merge
+//
+// One priority flood starts from the edge of the DEM (and the cells next to nodata), which is
+// the ocean, and from every pit, a cell with no lower neighbour. Every cell takes the label of
+// the pit whose flood reaches it first, so a label is the catchment of a pit, and where two
+// labels meet the lowest meeting point is kept as the outlet between them. Taking the outlets
+// from the lowest up (Kruskal) merges the depressions into a tree: two depressions that meet
+// at an outlet below any other way out fill to that outlet and then form a meta depression
+// holding both, a depression meeting the ocean spills out of the DEM there. Every depression
+// keeps its spill elevation, the depression its water goes to once it is full (across the
+// outlet), and its own cells: those under its spill elevation that are not in a child. Their
+// sorted elevations give the volume of the depression at any water level.
+//
+// Rain on the DEM is then routed through the tree alone: every pit gets the rain of its
+// catchment, a full depression passes the rest to the depression across its outlet, and two
+// full siblings fill their parent. A rainfall scenario costs a walk over the depressions
+// instead of a flood of the grid.
+
+const uint32_t OCEAN = 0; // depression 0: outside the DEM, holds any amount of water
+const uint32_t NO_DEPRESSION = UINT32_MAX;
+
+struct Depression {
+    uint32_t parent = OCEAN; // meta depression it merges into, OCEAN when it spills out of the DEM
+    uint32_t children[2] = { NO_DEPRESSION, NO_DEPRESSION }; // meta depressions: the two it holds
+    uint32_t overflow = OCEAN; // pit depression on the other side of the outlet
+    double spill = HUGE_VAL; // elevation of the outlet
+    uint64_t outlet = 0, beyond = 0; // cell_id of the outlet cell and of the cell across it
+    uint64_t pit = 0; // pits: cell_id of the pit
+    uint64_t catchment = 0; // pits and the ocean: cells draining to it
+    uint64_t area = 0; // cells under the spill elevation, children included
+    double total = 0; // sum of their elevations
+    double volume = 0; // water it holds when full, children included
+    size_t first_own = 0, own = 0; // its own cells in own_elevations
+    uint32_t tree = 0; // root of its tree, the depression spilling into the ocean
+};
+
+// Merge events in the order they happened: a meta depression formed or a root spilling out
+struct DepressionMerge {
+    uint32_t depression; // the meta depression, or the root that spills into the ocean
+    bool into_ocean;
+};
+
+struct DepressionHierarchy {
+    int max_x = 0, max_y = 0;
+    std::vector<Depression> depressions; // OCEAN, then pits and meta depressions as they form
+    std::vector<DepressionMerge> merges;
+    std::vector<uint32_t> label; // per cell_id: the pit it drains to, OCEAN, or NO_DEPRESSION for nodata
+    std::vector<double> own_elevations; // sorted per depression
+    std::vector<double> own_prefix; // sums of own_elevations from the start of each depression, inclusive
+
+    bool is_pit(uint32_t d) const {
+        return depressions[d].children[0] == NO_DEPRESSION;
+    }
+
+    uint32_t sibling(uint32_t d) const {
+        const Depression& parent = depressions[depressions[d].parent];
+        return parent.children[0] == d ? parent.children[1] : parent.children[0];
+    }
+
+    // Water level of a depression holding water (children included), when its children are full
+    double level_for(uint32_t d, double water) const {
+        const Depression& dep = depressions[d];
+        if (water >= dep.volume)
+            return dep.spill;
+        // cells below the level: the children, then the lowest k own cells
+        double area = 0, total = 0;
+        for (int c = 0; c < 2; ++c) {
+            if (dep.children[c] != NO_DEPRESSION) {
+                area += (double)depressions[dep.children[c]].area;
+                total += depressions[dep.children[c]].total;
+            }
+        }
+        const double* own = own_elevations.data() + dep.first_own;
+        const double* prefix = own_prefix.data() + dep.first_own;
+        auto volume_to = [&](size_t k) { // water up to own[k], with the k cells below it
+            return (area + k) * own[k] - (total + (k > 0 ? prefix[k - 1] : 0));
+        };
+        size_t lo = 0, hi = dep.own; // largest k with volume_to(k - 1) <= water
+        while (lo < hi) {
+            size_t mid = (lo + hi + 1) / 2;
+            if (volume_to(mid - 1) <= water)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        if (area + lo == 0)
+            return dep.spill;
+        double level = (water + total + (lo > 0 ? prefix[lo - 1] : 0)) / (area + lo);
+        return std::min(level, dep.spill);
+    }
+};
+
+// Index of the outlet of every pair of labels met, keys are both labels in 64 bits. Open
+// addressing keeps a lookup at one cache line, the flood looks up every boundary it crosses.
+struct OutletTable {
+    std::vector<std::pair<uint64_t, size_t> > slots;
+    size_t count = 0;
+    static constexpr uint64_t EMPTY = UINT64_MAX;
+
+    OutletTable() : slots(1 << 16, std::make_pair(EMPTY, (size_t)0)) {}
+
+    // Index stored for key, or index when key is new
+    size_t find_or_add(uint64_t key, size_t index) {
+        size_t mask = slots.size() - 1;
+        size_t i = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 20) & mask;
+        while (slots[i].first != EMPTY) {
+            if (slots[i].first == key)
+                return slots[i].second;
+            i = (i + 1) & mask;
+        }
+        slots[i] = std::make_pair(key, index);
+        if (++count * 2 > slots.size())
+            grow();
+        return index;
+    }
+
+    void grow() {
+        std::vector<std::pair<uint64_t, size_t> > old(slots.size() * 2, std::make_pair(EMPTY, (size_t)0));
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (size_t j = 0; j < old.size(); ++j) {
+            if (old[j].first == EMPTY)
+                continue;
+            size_t i = (size_t)((old[j].first * 0x9E3779B97F4A7C15ULL) >> 20) & mask;
+            while (slots[i].first != EMPTY)
+                i = (i + 1) & mask;
+            slots[i] = old[j];
+        }
+    }
+};
+
+// Build the hierarchy of input_raster, cells in mask (nodata) are left out like the outside
+template <template <typename> class Queue, typename Z>
+void build_depressions(const Raster<Z>& input_raster, const NodataMask* mask, DepressionHierarchy& hierarchy) {
+    int max_x = input_raster.max_x, max_y = input_raster.max_y;
+    size_t total = (size_t)max_x * max_y;
+    hierarchy = DepressionHierarchy();
+    hierarchy.max_x = max_x;
+    hierarchy.max_y = max_y;
+    std::vector<Depression>& deps = hierarchy.depressions;
+    std::vector<uint32_t>& label = hierarchy.label;
+    deps.resize(1);
+    label.assign(total, NO_DEPRESSION);
+    std::vector<uint8_t> queued(total, 0); // 1 once queued, 2 once popped
+
+    double min_level, max_level;
+    elevation_range(input_raster, 0, 0, max_x - 1, max_y - 1, min_level, max_level, mask);
+    Queue<RasterCell> cells(min_level, max_level);
+    uint64_t insert_order = 0;
+    auto push = [&](int x, int y) {
+        queued[input_raster.cell_id(x, y)] = 1;
+        cells.push(RasterCell(x, y, input_raster(x, y), insert_order++, 0));
+    };
+    auto inside = [&](int x, int y) {
+        return x >= 0 && y >= 0 && x < max_x && y < max_y && !is_masked(mask, x, y);
+    };
+
+    // the ocean: the edge and the cells next to nodata
+    for (int y = 0; y < max_y; ++y) {
+        for (int x = 0; x < max_x; ++x) {
+            if (y > 0 && y < max_y - 1 && x > 0 && x < max_x - 1)
+                x = max_x - 1;
+            if (inside(x, y) && !queued[input_raster.cell_id(x, y)]) {
+                label[input_raster.cell_id(x, y)] = OCEAN;
+                push(x, y);
+            }
+        }
+    }
+    if (mask != NULL) {
+        for_each_mask_border(*mask, 0, 0, max_x - 1, max_y - 1, [&](int x, int y) {
+            if (!queued[input_raster.cell_id(x, y)]) {
+                label[input_raster.cell_id(x, y)] = OCEAN;
+                push(x, y);
+            }
+        });
+    }
+    // pits, labelled when they come out of the queue unless a flat neighbour got there first
+    for (int y = 1; y < max_y - 1; ++y) {
+        for (int x = 1; x < max_x - 1; ++x) {
+            if (!inside(x, y) || queued[input_raster.cell_id(x, y)])
+                continue;
+            double z = input_raster(x, y);
+            bool lower = false;
+            for (int dy = -1; dy <= 1 && !lower; ++dy)
+                for (int dx = -1; dx <= 1 && !lower; ++dx)
+                    lower = (dx != 0 || dy != 0) && input_raster(x + dx, y + dy) < z;
+            if (!lower)
+                push(x, y);
+        }
+    }
+
+    // lowest outlet between every pair of labels
+    struct Outlet {
+        double elevation;
+        uint32_t a, b; // labels of cell_a and cell_b
+        uint64_t cell_a, cell_b;
+    };
+    std::vector<Outlet> outlets;
+    OutletTable outlet_of;
+    while (!cells.empty()) {
+        RasterCell cell = cells.top();
+        cells.pop();
+        uint64_t id = input_raster.cell_id(cell.x, cell.y);
+        queued[id] = 2;
+        if (label[id] == NO_DEPRESSION) {
+            Depression pit;
+            pit.pit = id;
+            label[id] = (uint32_t)deps.size();
+            deps.push_back(pit);
+        }
+        uint32_t a = label[id];
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                int x = cell.x + dx, y = cell.y + dy;
+                if ((dx == 0 && dy == 0) || !inside(x, y))
+                    continue;
+                uint64_t n = input_raster.cell_id(x, y);
+                if (label[n] == NO_DEPRESSION) {
+                    // cells lower than the one popped are labelled already, so the label
+                    // spreads upwards from the pit
+                    label[n] = a;
+                    if (!queued[n])
+                        push(x, y);
+                }
+                else if (label[n] != a && queued[n] == 2) {
+                    // each pair of neighbours is looked at once, when the second of them is popped
+                    uint32_t b = label[n];
+                    Outlet outlet = { std::max(cell.elevation, (double)input_raster(x, y)), a, b, id, n };
+                    uint64_t pair = a < b ? ((uint64_t)a << 32 | b) : ((uint64_t)b << 32 | a);
+                    size_t i = outlet_of.find_or_add(pair, outlets.size());
+                    if (i == outlets.size())
+                        outlets.push_back(outlet);
+                    if (outlet.elevation < outlets[i].elevation)
+                        outlets[i] = outlet;
+                }
+            }
+        }
+    }
+    std::vector<std::pair<uint64_t, size_t> >().swap(outlet_of.slots);
+
+    // merge from the lowest outlet up, the ocean stays the root of its set
+    std::sort(outlets.begin(), outlets.end(), [](const Outlet& p, const Outlet& q) {
+        if (p.elevation != q.elevation)
+            return p.elevation < q.elevation;
+        if (std::min(p.a, p.b) != std::min(q.a, q.b))
+            return std::min(p.a, p.b) < std::min(q.a, q.b);
+        return std::max(p.a, p.b) < std::max(q.a, q.b);
+    });
+    std::vector<uint32_t> root(deps.size());
+    for (size_t d = 0; d < root.size(); ++d)
+        root[d] = (uint32_t)d;
+    auto find = [&](uint32_t d) {
+        while (root[d] != d) {
+            root[d] = root[root[d]];
+            d = root[d];
+        }
+        return d;
+    };
+    for (size_t i = 0; i < outlets.size(); ++i) {
+        const Outlet& o = outlets[i];
+        uint32_t ra = find(o.a), rb = find(o.b);
+        if (ra == rb)
+            continue;
+        if (ra == OCEAN || rb == OCEAN) {
+            bool a_side = rb == OCEAN;
+            uint32_t r = a_side ? ra : rb;
+            Depression& dep = deps[r];
+            dep.parent = OCEAN;
+            dep.spill = o.elevation;
+            dep.overflow = a_side ? o.b : o.a;
+            dep.outlet = a_side ? o.cell_a : o.cell_b;
+            dep.beyond = a_side ? o.cell_b : o.cell_a;
+            root[r] = OCEAN;
+            DepressionMerge merge = { r, true };
+            hierarchy.merges.push_back(merge);
+            continue;
+        }
+        uint32_t m = (uint32_t)deps.size();
+        Depression meta;
+        meta.children[0] = ra;
+        meta.children[1] = rb;
+        deps.push_back(meta);
+        root.push_back(m);
+        Depression& da = deps[ra];
+        Depression& db = deps[rb];
+        da.parent = db.parent = m;
+        da.spill = db.spill = o.elevation;
+        da.overflow = o.b;
+        db.overflow = o.a;
+        da.outlet = db.beyond = o.cell_a;
+        da.beyond = db.outlet = o.cell_b;
+        root[ra] = root[rb] = m;
+        DepressionMerge merge = { m, false };
+        hierarchy.merges.push_back(merge);
+    }
+
+    // every cell under the spill of its pit's tree belongs to the lowest depression it is under.
+    // Going through the cells from the lowest up, the merges below a cell are done before it
+    // and its pit's set is that depression, or the ocean once the tree spilled out below it.
+    std::vector<std::pair<Z, uint64_t> > by_elevation;
+    for (int y = 0; y < max_y; ++y) {
+        for (int x = 0; x < max_x; ++x) {
+            uint64_t id = input_raster.cell_id(x, y);
+            if (label[id] == NO_DEPRESSION)
+                continue;
+            deps[label[id]].catchment++;
+            if (label[id] == OCEAN)
+                continue;
+            by_elevation.push_back(std::make_pair(input_raster(x, y), id));
+        }
+    }
+    std::sort(by_elevation.begin(), by_elevation.end());
+    for (size_t d = 0; d < root.size(); ++d)
+        root[d] = (uint32_t)d;
+    std::vector<uint32_t> owner(total, NO_DEPRESSION);
+    std::vector<size_t> count(deps.size() + 1, 0);
+    size_t merged = 0;
+    for (size_t i = 0; i < by_elevation.size(); ++i) {
+        double z = by_elevation[i].first;
+        for (; merged < hierarchy.merges.size(); ++merged) {
+            const DepressionMerge& merge = hierarchy.merges[merged];
+            const Depression& dep = deps[merge.depression];
+            if (merge.into_ocean ? dep.spill > z : deps[dep.children[0]].spill > z)
+                break;
+            if (merge.into_ocean)
+                root[merge.depression] = OCEAN;
+            else
+                root[dep.children[0]] = root[dep.children[1]] = merge.depression;
+        }
+        uint32_t d = find(label[by_elevation[i].second]);
+        if (d != OCEAN) {
+            owner[by_elevation[i].second] = d;
+            count[d + 1]++;
+        }
+    }
+    std::vector<std::pair<Z, uint64_t> >().swap(by_elevation);
+    for (size_t d = 0; d < deps.size(); ++d) {
+        deps[d].first_own = count[d];
+        deps[d].own = count[d + 1];
+        count[d + 1] += count[d];
+    }
+    hierarchy.own_elevations.resize(count[deps.size()]);
+    for (int y = 0; y < max_y; ++y) {
+        for (int x = 0; x < max_x; ++x) {
+            uint32_t d = owner[input_raster.cell_id(x, y)];
+            if (d != NO_DEPRESSION)
+                hierarchy.own_elevations[count[d]++] = input_raster(x, y);
+        }
+    }
+    std::vector<uint32_t>().swap(owner);
+    hierarchy.own_prefix.resize(hierarchy.own_elevations.size());
+    for (size_t d = 1; d < deps.size(); ++d) {
+        Depression& dep = deps[d];
+        double* own = hierarchy.own_elevations.data() + dep.first_own;
+        std::sort(own, own + dep.own);
+        double sum = 0;
+        for (size_t k = 0; k < dep.own; ++k) {
+            sum += own[k];
+            hierarchy.own_prefix[dep.first_own + k] = sum;
+        }
+        // children come before their parent
+        dep.area = dep.own;
+        dep.total = sum;
+        for (int c = 0; c < 2; ++c) {
+            if (dep.children[c] != NO_DEPRESSION) {
+                dep.area += deps[dep.children[c]].area;
+                dep.total += deps[dep.children[c]].total;
+            }
+        }
+        dep.volume = dep.spill == HUGE_VAL ? 0 : std::max(0.0, dep.area * dep.spill - dep.total);
+    }
+    for (size_t d = deps.size() - 1; d > 0; --d)
+        deps[d].tree = deps[d].parent == OCEAN ? (uint32_t)d : deps[deps[d].parent].tree;
+}
+
+// Water held by every depression (children included) after rain of depth (elevation units)
+// on every cell, and the water leaving the DEM
+struct FillSpillMerge {
+    const DepressionHierarchy& hierarchy;
+    std::vector<double> capacity; // volume of a depression above its children
+    std::vector<double> water; // after run: water in a depression and its children
+    double outflow = 0;
+
+    // while running: water above the children, the depressions that are full, and where the
+    // water poured into a depression rises to (itself, or up past full pairs of siblings)
+    std::vector<double> extra;
+    std::vector<uint8_t> filled;
+    std::vector<uint32_t> rise;
+    std::vector<std::pair<uint32_t, uint32_t> > climbs; // pour: depression reached, top of its climb
+    std::vector<uint32_t> passes; // full trees: the first pit past them in a tree that is not full
+
+    FillSpillMerge(const DepressionHierarchy& hierarchy) : hierarchy(hierarchy) {
+        const std::vector<Depression>& deps = hierarchy.depressions;
+        capacity.resize(deps.size(), 0);
+        for (size_t d = 1; d < deps.size(); ++d) {
+            capacity[d] = deps[d].volume;
+            for (int c = 0; c < 2; ++c)
+                if (deps[d].children[c] != NO_DEPRESSION)
+                    capacity[d] -= deps[deps[d].children[c]].volume;
+            capacity[d] = std::max(0.0, capacity[d]);
+        }
+    }
+
+    bool full(uint32_t d) const {
+        return filled[d] != 0;
+    }
+
+    // Fill d above its children with what it takes of amount, the rest is returned
+    double fill(uint32_t d, double amount) {
+        double take = std::min(amount, std::max(0.0, capacity[d] - extra[d]));
+        extra[d] += take;
+        if (extra[d] >= capacity[d] - 1e-9 * std::max(1.0, capacity[d]))
+            filled[d] = 1;
+        return amount - take;
+    }
+
+    uint32_t find_rise(uint32_t d) {
+        while (rise[d] != d) {
+            rise[d] = rise[rise[d]];
+            d = rise[d];
+        }
+        return d;
+    }
+
+    // Both children of a depression are full, water poured into either rises into it
+    void join(uint32_t a, uint32_t b) {
+        rise[a] = rise[b] = hierarchy.depressions[a].parent;
+    }
+
+    // Pour amount into pit and let it spread through the tree up to top, the rest is returned.
+    // A full depression passes the water across its outlet into its sibling, and once both
+    // are full it rises in their parent.
+    double pour(uint32_t pit, double amount, uint32_t top) {
+        const std::vector<Depression>& deps = hierarchy.depressions;
+        climbs.clear();
+        climbs.push_back(std::make_pair(pit, top));
+        while (amount > 0 && !climbs.empty()) {
+            uint32_t climb_top = climbs.back().second;
+            if (full(climb_top)) {
+                // full up to the top of this climb, back to the climb that poured into it
+                climbs.pop_back();
+                if (!climbs.empty()) {
+                    uint32_t d = climbs.back().first;
+                    join(d, climb_top);
+                    climbs.back().first = deps[d].parent;
+                }
+                continue;
+            }
+            // full depressions below climb_top with full siblings are passed at once
+            uint32_t d = find_rise(climbs.back().first);
+            climbs.back().first = d;
+            amount = fill(d, amount);
+            if (!full(d) || d == climb_top)
+                continue;
+            uint32_t s = hierarchy.sibling(d);
+            if (!full(s)) {
+                climbs.push_back(std::make_pair(deps[d].overflow, s));
+            }
+            else {
+                join(d, s);
+                climbs.back().first = deps[d].parent;
+            }
+        }
+        return amount;
+    }
+
+    // The first pit from pit on whose tree is not full, or OCEAN. Water passes straight through
+    // full trees and they stay full, so the way past them is remembered.
+    uint32_t open_target(uint32_t pit) {
+        const std::vector<Depression>& deps = hierarchy.depressions;
+        uint32_t target = pit;
+        while (target != OCEAN && full(deps[target].tree))
+            target = passes[deps[target].tree];
+        while (pit != target) {
+            uint32_t tree = deps[pit].tree;
+            pit = passes[tree];
+            passes[tree] = target;
+        }
+        return target;
+    }
+
+    void run(double depth) {
+        const std::vector<Depression>& deps = hierarchy.depressions;
+        extra.assign(deps.size(), 0);
+        filled.assign(deps.size(), 0);
+        rise.resize(deps.size());
+        passes.resize(deps.size());
+        for (size_t d = 0; d < deps.size(); ++d) {
+            rise[d] = (uint32_t)d;
+            passes[d] = deps[d].overflow;
+        }
+        std::vector<double> pending(deps.size(), 0); // water a depression could not hold
+        // rain on cells draining straight out of the DEM
+        outflow = depth * deps[OCEAN].catchment;
+        for (size_t d = 1; d < deps.size(); ++d)
+            if (hierarchy.is_pit((uint32_t)d))
+                pending[d] = fill((uint32_t)d, depth * deps[d].catchment);
+
+        for (size_t i = 0; i < hierarchy.merges.size(); ++i) {
+            uint32_t d = hierarchy.merges[i].depression;
+            if (!hierarchy.merges[i].into_ocean) {
+                // a full child spills into its sibling, what neither holds rises in d
+                uint32_t a = deps[d].children[0], b = deps[d].children[1];
+                if (pending[a] > 0 && !full(b))
+                    pending[a] = pour(deps[a].overflow, pending[a], b);
+                if (pending[b] > 0 && !full(a))
+                    pending[b] = pour(deps[b].overflow, pending[b], a);
+                if (full(a) && full(b)) {
+                    join(a, b);
+                    pending[d] = fill(d, pending[a] + pending[b]);
+                }
+                continue;
+            }
+            // a root spills into the pit across its outlet, and on through the trees below it
+            double amount = pending[d];
+            uint32_t target = deps[d].overflow;
+            while (amount > 0) {
+                target = open_target(target);
+                if (target == OCEAN) {
+                    outflow += amount;
+                    break;
+                }
+                uint32_t tree = deps[target].tree;
+                amount = pour(target, amount, tree);
+                target = deps[tree].overflow;
+            }
+        }
+
+        // children come before their parent
+        water.assign(deps.size(), 0);
+        for (size_t d = 1; d < deps.size(); ++d) {
+            water[d] = extra[d];
+            for (int c = 0; c < 2; ++c)
+                if (deps[d].children[c] != NO_DEPRESSION)
+                    water[d] += water[deps[d].children[c]];
+        }
+    }
+
+    // Water level of every depression over the cells it owns, -HUGE_VAL for the ocean. A full
+    // depression stands at its spill elevation unless its sibling is full too, then it is under
+    // the water of its parent, which was formed later and is looked at first.
+    void levels(std::vector<double>& level) const {
+        const std::vector<Depression>& deps = hierarchy.depressions;
+        level.assign(deps.size(), -HUGE_VAL);
+        for (size_t i = deps.size() - 1; i > 0; --i) {
+            uint32_t d = (uint32_t)i;
+            if (!full(d))
+                level[d] = hierarchy.level_for(d, water[d]);
+            else if (deps[d].parent == OCEAN || !full(hierarchy.sibling(d)))
+                level[d] = deps[d].spill;
+            else
+                level[d] = level[deps[d].parent];
+        }
+    }
+};
+
+// Write the depressions as a table: id, parent, children, overflow, spill, outlet and pit
+// (x y, -1 -1 when none), catchment and area in cells, volume in elevation units x cells
+inline bool write_depressions(const std::string& filename, const DepressionHierarchy& hierarchy) {
+    FILE* file = fopen(filename.c_str(), "w");
+    if (file == NULL) {
+        std::cerr << "Couldn't write " << filename << std::endl;
+        return false;
+    }
+    int max_x = hierarchy.max_x;
+    fprintf(file, "id,parent,child_a,child_b,overflow,spill,outlet_x,outlet_y,pit_x,pit_y,catchment,area,volume\n");
+    for (size_t d = 1; d < hierarchy.depressions.size(); ++d) {
+        const Depression& dep = hierarchy.depressions[d];
+        bool pit = hierarchy.is_pit((uint32_t)d);
+        fprintf(file, "%zu,%d,%d,%d,%u,%.10g,%d,%d,%d,%d,%llu,%llu,%.10g\n", d,
+            dep.parent == OCEAN ? -1 : (int)dep.parent,
+            pit ? -1 : (int)dep.children[0], pit ? -1 : (int)dep.children[1], dep.overflow, dep.spill,
+            (int)(dep.outlet % max_x), (int)(dep.outlet / max_x),
+            pit ? (int)(dep.pit % max_x) : -1, pit ? (int)(dep.pit / max_x) : -1,
+            (unsigned long long)dep.catchment, (unsigned long long)dep.area, dep.volume);
+    }
+    bool ok = fclose(file) == 0;
+    if (!ok)
+        std::cerr << "Couldn't write " << filename << std::endl;
+    return ok;
+}
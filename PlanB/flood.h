@@ -0,0 +1,514 @@
+#pragma once
+#include <queue>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+
+#include "raster.h"
+#include "parallel.h"
+#include "queue.h"
+#include "checkpoint.h"
+
+
+// Offset from a cell to one of its neighbours
+struct Offset {
+    int dx, dy;
+};
+
+// Flow direction code of a cell draining to its neighbour at (dx, dy)
+inline int flow_code(int dx, int dy) {
+    static const int codes[3][3] = { { 10, 20, 30 }, { 40, 0, 50 }, { 60, 70, 80 } };
+    return codes[dy + 1][dx + 1];
+}
+
+// Neighbours of a cell in the order the flood visits them, which depends on where the cell is
+// in the raster (centre, corner or edge). The order decides which cell gets the lower insertion
+// order on ties, so it is kept exactly as it was when every case was written out by hand.
+inline int neighbour_order(int x, int y, int max_x, int max_y, const Offset*& order) {
+    static const Offset centre[8] = { { 1, 1 }, { -1, 1 }, { 0, 1 }, { 1, 0 }, { -1, 0 }, { 1, -1 }, { 0, -1 }, { -1, -1 } };
+    static const Offset top_left[3] = { { 1, 0 }, { 0, 1 }, { 1, 1 } };
+    static const Offset top_right[3] = { { -1, 0 }, { 0, 1 }, { -1, 1 } };
+    static const Offset bottom_left[3] = { { 0, -1 }, { 1, 0 }, { 1, -1 } };
+    static const Offset bottom_right[3] = { { -1, 0 }, { -1, -1 }, { 0, -1 } };
+    static const Offset left[5] = { { 1, 0 }, { 0, 1 }, { 1, 1 }, { 0, -1 }, { 1, -1 } };
+    static const Offset right[5] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { -1, -1 }, { -1, 1 } };
+    static const Offset top[5] = { { 1, 1 }, { -1, 1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+    static const Offset bottom[5] = { { 1, 0 }, { -1, 0 }, { 1, -1 }, { 0, -1 }, { -1, -1 } };
+
+    if (x == 0 && y == 0) { order = top_left; return 3; }
+    if (x > 0 && x < max_x - 1 && y > 0 && y < max_y - 1) { order = centre; return 8; }
+    if (x == max_x - 1 && y == 0) { order = top_right; return 3; }
+    if (x == 0 && y == max_y - 1) { order = bottom_left; return 3; }
+    if (x == max_x - 1 && y == max_y - 1) { order = bottom_right; return 3; }
+    if (x == 0) { order = left; return 5; }
+    if (x == max_x - 1) { order = right; return 5; }
+    if (y == 0) { order = top; return 5; }
+    order = bottom;
+    return 5;
+}
+
+// Lowest and highest elevation in the cells [x0, x1] x [y0, y1], nodata left out
+template <typename Z>
+void elevation_range(const Raster<Z>& input_raster, int x0, int y0, int x1, int y1, double& min_level, double& max_level,
+    const NodataMask* mask = NULL) {
+    min_level = HUGE_VAL;
+    max_level = -HUGE_VAL;
+    for (int y = y0; y <= y1; ++y) {
+        for (int x = x0; x <= x1; ++x) {
+            if (is_masked(mask, x, y))
+                continue;
+            double z = input_raster(x, y);
+            min_level = std::min(min_level, z);
+            max_level = std::max(max_level, z);
+        }
+    }
+}
+
+// Flood the DEM from its boundary. Every cell takes the direction of the cell that first
+// reached it, and cells are appended to cells_to_process_accumulation in the order they leave
+// the queue. Ties between equal elevations go to the lower insertion order. Queue is
+// HeapQueue or BucketQueue (integer elevations), both give the same result. Cells in mask
+// (nodata) are never queued and keep direction 0; the cells next to them are outlets like the boundary.
+// With a checkpoint, segments are written to it as the flood goes (see checkpoint.h) and a
+// resumed checkpoint is carried on from instead of seeding the boundary.
+template <template <typename> class Queue, typename Z, typename Store>
+void flood_serial(const Raster<Z>& input_raster, Raster<unsigned int, Store>& flow_direction, std::deque<CellPosition>& cells_to_process_accumulation,
+    const NodataMask* mask = NULL, FloodCheckpoint* checkpoint = NULL) {
+    int nXSize = input_raster.max_x;
+    int nYSize = input_raster.max_y;
+    uint64_t insert_order = 0;
+    double min_level, max_level;
+    elevation_range(input_raster, 0, 0, nXSize - 1, nYSize - 1, min_level, max_level, mask);
+    Queue<RasterCell> cells_to_process_flow(min_level, max_level);
+
+    // start an outlet at a cell with data
+    auto seed = [&](int x, int y) {
+        if (is_masked(mask, x, y))
+            return;
+        cells_to_process_flow.push(RasterCell(x, y, input_raster(x, y), insert_order, 0));
+        flow_direction.Add_to_queue(x, y);
+        insert_order++;
+    };
+
+    if (checkpoint != NULL && checkpoint->resumed) {
+        // the queue of the checkpoint, pushed in insertion order so both queues pop it as before
+        std::vector<RasterCell>& queued = checkpoint->queue;
+        std::sort(queued.begin(), queued.end(), [](const RasterCell& a, const RasterCell& b) { return a.insertion_order < b.insertion_order; });
+        for (size_t i = 0; i < queued.size(); ++i)
+            cells_to_process_flow.push(queued[i]);
+        insert_order = checkpoint->insert_order;
+        std::vector<RasterCell>().swap(queued);
+    }
+    else {
+        //add the cell on the boundary(the first and the last row) and choose the initial pixel
+        for (int i = 0; i < nXSize; i++)
+        {
+            seed(i, 0);
+            seed(i, nYSize - 1);
+        }
+
+        //add the cell on the boundary(the first and the last column) and choose the initial pixel
+        for (int j = 1; j < nYSize - 1; j++)
+        {
+            seed(0, j);
+            seed(nXSize - 1, j);
+        }
+
+        // add the cells next to nodata
+        if (mask != NULL) {
+            for_each_mask_border(*mask, 0, 0, nXSize - 1, nYSize - 1, [&](int x, int y) {
+                if (flow_direction.If_add_to_queue(x, y) == 0)
+                    seed(x, y);
+            });
+        }
+    }
+
+    while (cells_to_process_flow.empty() != true)
+    {
+        //select the lowest elevation cell in the priority queue
+        RasterCell start_raster = cells_to_process_flow.top();
+        cells_to_process_flow.pop();
+
+        // calculate neighbours direction
+        const Offset* order;
+        int neighbours = neighbour_order(start_raster.x, start_raster.y, nXSize, nYSize, order);
+        for (int k = 0; k < neighbours; ++k)
+        {
+            int x = start_raster.x + order[k].dx;
+            int y = start_raster.y + order[k].dy;
+            // boundary cells are queued from the start and stay outlets
+            if (flow_direction.If_add_to_queue(x, y) == 0 && !is_masked(mask, x, y))
+            {
+                int dir = flow_code(-order[k].dx, -order[k].dy);
+                flow_direction.Add_to_queue(x, y);
+                cells_to_process_flow.push(RasterCell(x, y, input_raster(x, y), insert_order, dir));
+                insert_order++;
+                flow_direction(x, y) = dir;
+            }
+        }
+
+        // change the visit status of each cell
+        flow_direction.Is_Visited(start_raster.x, start_raster.y);
+        // add to the cell to the stack to calculate flow accumulation later
+        cells_to_process_accumulation.push_back(CellPosition(start_raster.x, start_raster.y));
+
+        if (checkpoint != NULL) {
+            checkpoint->pop(flow_direction.cell_id(start_raster.x, start_raster.y), start_raster.flow_dir);
+            if (checkpoint->due())
+                checkpoint->write(cells_to_process_flow, insert_order, cells_to_process_accumulation, flow_direction);
+        }
+    }
+    // a last segment with the queue empty, a resumed run then goes straight to the outputs
+    if (checkpoint != NULL)
+        checkpoint->write(cells_to_process_flow, insert_order, cells_to_process_accumulation, flow_direction);
+}
+
+
+// Parallel flood
+//
+// The raster is cut into tiles of a fixed size. Each tile is flooded on its own from all of
+// its perimeter cells, so every cell in the tile drains to one perimeter cell (its root) and
+// the trees of neighbouring roots meet along spill edges. The roots form a small graph, with
+// edges where two trees meet inside a tile, between touching perimeter cells of neighbouring
+// tiles, and to the outside for cells on the raster edge. A priority flood over that graph from
+// the outside finds, for every root, the lowest spill through which its tree drains. Each
+// tree is then re-rooted at that spill cell.
+//
+// Tiles are independent and the graph is solved serially with ties broken on node ids that
+// only depend on the tile layout, so the directions are identical for any number of threads.
+// Keys and cell indices are 64 bits.
+
+// Tile of the parallel flood, bounds inclusive
+struct FloodTile {
+    int x0, y0, x1, y1;
+    uint32_t first_node; // spill graph id of the first perimeter cell, the nodata root follows the perimeter
+
+    int width() const { return x1 - x0 + 1; }
+    int height() const { return y1 - y0 + 1; }
+
+    // Number of cells on the tile border
+    int perimeter() const {
+        int w = width(), h = height();
+        return w + (h > 1 ? w : 0) + (h > 2 ? h - 2 : 0) * (w > 1 ? 2 : 1);
+    }
+
+    bool on_perimeter(int x, int y) const {
+        return x == x0 || x == x1 || y == y0 || y == y1;
+    }
+
+    // Index of a border cell: top row, bottom row, left column, right column
+    int perimeter_index(int x, int y) const {
+        int w = width(), h = height();
+        if (y == y0)
+            return x - x0;
+        if (y == y1)
+            return w + x - x0;
+        int sides = w + (h > 1 ? w : 0);
+        if (x == x0)
+            return sides + y - y0 - 1;
+        return sides + (h - 2) + y - y0 - 1;
+    }
+
+    // Cell of a perimeter index
+    void perimeter_cell(int k, int& x, int& y) const {
+        int w = width(), h = height();
+        int sides = w + (h > 1 ? w : 0);
+        if (k < w) { x = x0 + k; y = y0; }
+        else if (k < sides) { x = x0 + k - w; y = y1; }
+        else if (k < sides + h - 2) { x = x0; y = y0 + 1 + k - sides; }
+        else { x = x1; y = y0 + 1 + k - sides - (h - 2); }
+    }
+};
+
+// Where the trees of two roots meet: cell_u belongs to the tree of u, cell_v to v
+struct SpillEdge {
+    uint32_t u, v;
+    double weight; // water level at which the two trees connect
+    uint64_t cell_u, cell_v; // cell_id of the two cells
+};
+
+const uint32_t NO_NODE = UINT32_MAX;
+const uint64_t OUTSIDE = UINT64_MAX;
+
+// Entry of the flood queues, lowest level first then lowest key
+struct FloodEntry {
+    double level;
+    uint64_t key;
+    uint32_t id;
+
+    bool operator<(const FloodEntry& other) const {
+        if (level != other.level)
+            return level > other.level;
+        return key > other.key;
+    }
+};
+
+inline double queue_level(const FloodEntry& entry) {
+    return entry.level;
+}
+
+// Flood one tile from its perimeter: set the directions of its interior cells towards their
+// roots and collect the spill edges between roots, including those to neighbouring tiles.
+// Interior cells next to nodata share one more root after the perimeter, an outlet of the graph;
+// perimeter cells next to nodata are outlets of their own.
+template <template <typename> class Queue, typename Z, typename Store>
+void flood_tile(const Raster<Z>& input_raster, Raster<unsigned int, Store>& flow_direction, const FloodTile& tile,
+    const std::vector<FloodTile>& tiles, int tiles_x, int tile_size,
+    std::vector<SpillEdge>& edges, std::vector<std::pair<uint32_t, double> >& outlets, const NodataMask* mask) {
+    int w = tile.width(), h = tile.height();
+    int max_x = input_raster.max_x, max_y = input_raster.max_y;
+    std::vector<uint32_t> label((size_t)w * h, NO_NODE);
+    std::vector<double> level((size_t)w * h, 0);
+    double min_level, max_level;
+    elevation_range(input_raster, tile.x0, tile.y0, tile.x1, tile.y1, min_level, max_level, mask);
+    Queue<FloodEntry> queue(min_level, max_level);
+    uint64_t key = 0;
+
+    for (int k = 0; k < tile.perimeter(); ++k) {
+        int x, y;
+        tile.perimeter_cell(k, x, y);
+        if (is_masked(mask, x, y))
+            continue;
+        uint32_t local = (uint32_t)((y - tile.y0) * w + (x - tile.x0));
+        double z = input_raster(x, y);
+        label[local] = (uint32_t)k;
+        level[local] = z;
+        flow_direction(x, y) = 0;
+        FloodEntry seed = { z, key++, local };
+        queue.push(seed);
+        // on the raster edge or next to nodata it is an outlet, as the serial flood seeds it
+        bool outlet = x == 0 || y == 0 || x == max_x - 1 || y == max_y - 1;
+        for (int dy = -1; dy <= 1 && !outlet && mask != NULL; ++dy)
+            for (int dx = -1; dx <= 1 && !outlet; ++dx)
+                outlet = is_masked(mask, x + dx, y + dy);
+        if (outlet)
+            outlets.push_back(std::make_pair(tile.first_node + k, z));
+    }
+    if (mask != NULL) {
+        uint32_t nodata_root = (uint32_t)tile.perimeter();
+        bool seeded = false;
+        for_each_mask_border(*mask, tile.x0, tile.y0, tile.x1, tile.y1, [&](int x, int y) {
+            uint32_t local = (uint32_t)((y - tile.y0) * w + (x - tile.x0));
+            if (label[local] != NO_NODE)
+                return;
+            double z = input_raster(x, y);
+            label[local] = nodata_root;
+            level[local] = z;
+            flow_direction(x, y) = 0;
+            FloodEntry seed = { z, key++, local };
+            queue.push(seed);
+            seeded = true;
+        });
+        if (seeded)
+            outlets.push_back(std::make_pair(tile.first_node + nodata_root, -HUGE_VAL));
+    }
+
+    // spill edges inside the tile, keeping the lowest one per pair of roots
+    std::unordered_map<uint64_t, size_t> pair_edge;
+    while (!queue.empty()) {
+        FloodEntry top = queue.top();
+        queue.pop();
+        int cx = tile.x0 + (int)(top.id % w), cy = tile.y0 + (int)(top.id / w);
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                int x = cx + dx, y = cy + dy;
+                if ((dx == 0 && dy == 0) || x < tile.x0 || x > tile.x1 || y < tile.y0 || y > tile.y1 || is_masked(mask, x, y))
+                    continue;
+                uint32_t local = (uint32_t)((y - tile.y0) * w + (x - tile.x0));
+                if (label[local] == NO_NODE) {
+                    label[local] = label[top.id];
+                    level[local] = std::max((double)input_raster(x, y), top.level);
+                    flow_direction(x, y) = flow_code(-dx, -dy);
+                    FloodEntry next = { level[local], key++, local };
+                    queue.push(next);
+                }
+                else if (label[local] != label[top.id]) {
+                    uint32_t a = label[top.id], b = label[local];
+                    uint64_t pair = a < b ? ((uint64_t)a << 32 | b) : ((uint64_t)b << 32 | a);
+                    SpillEdge edge = { tile.first_node + a, tile.first_node + b, std::max(top.level, level[local]),
+                        input_raster.cell_id(cx, cy), input_raster.cell_id(x, y) };
+                    auto found = pair_edge.find(pair);
+                    if (found == pair_edge.end()) {
+                        pair_edge[pair] = edges.size();
+                        edges.push_back(edge);
+                    }
+                    else if (edge.weight < edges[found->second].weight) {
+                        edges[found->second] = edge;
+                    }
+                }
+            }
+        }
+    }
+
+    // edges to the perimeter cells of the tiles right of and below this one, each pair of
+    // touching cells is taken once, from the cell that comes first in the raster
+    static const Offset forward[4] = { { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+    for (int k = 0; k < tile.perimeter(); ++k) {
+        int x, y;
+        tile.perimeter_cell(k, x, y);
+        if (is_masked(mask, x, y))
+            continue;
+        for (int f = 0; f < 4; ++f) {
+            int nx = x + forward[f].dx, ny = y + forward[f].dy;
+            if (nx < 0 || ny < 0 || nx >= max_x || ny >= max_y || is_masked(mask, nx, ny))
+                continue;
+            if (nx >= tile.x0 && nx <= tile.x1 && ny >= tile.y0 && ny <= tile.y1)
+                continue;
+            const FloodTile& other = tiles[(ny / tile_size) * tiles_x + nx / tile_size];
+            SpillEdge edge = { tile.first_node + k, other.first_node + (uint32_t)other.perimeter_index(nx, ny),
+                std::max((double)input_raster(x, y), (double)input_raster(nx, ny)), input_raster.cell_id(x, y), input_raster.cell_id(nx, ny) };
+            edges.push_back(edge);
+        }
+    }
+}
+
+// Turn the tree of a root around so that it drains out of spill_cell into target (or leaves
+// the raster when target is OUTSIDE). Only the cells on the path from spill_cell to the root change.
+template <typename Store>
+void reroot_tree(Raster<unsigned int, Store>& flow_direction, uint64_t spill_cell, uint64_t target) {
+    int max_x = flow_direction.max_x;
+    int x = (int)(spill_cell % max_x), y = (int)(spill_cell / max_x);
+    int dir = 0;
+    if (target != OUTSIDE)
+        dir = flow_code((int)(target % max_x) - x, (int)(target / max_x) - y);
+    while (true) {
+        int old_dir = flow_direction(x, y);
+        flow_direction(x, y) = dir;
+        int nx = x, ny = y;
+        if (!flow_target(old_dir, nx, ny))
+            break;
+        dir = flow_code(x - nx, y - ny);
+        x = nx;
+        y = ny;
+    }
+}
+
+// Flood the DEM in parallel tiles, see above. tile_size must not depend on threads for the
+// output to be reproducible across thread counts. Queue is the queue of the tile floods, the
+// graph of roots always uses a heap as its ties are broken on node ids.
+template <template <typename> class Queue, typename Z, typename Store>
+void flood_parallel(const Raster<Z>& input_raster, Raster<unsigned int, Store>& flow_direction, int tile_size, int threads,
+    const NodataMask* mask = NULL) {
+    static_assert(!store_shares_bytes<Store>::value, "tiles are written from several threads");
+    int max_x = input_raster.max_x, max_y = input_raster.max_y;
+    int tiles_x = (max_x + tile_size - 1) / tile_size;
+    int tiles_y = (max_y + tile_size - 1) / tile_size;
+    std::vector<FloodTile> tiles;
+    uint32_t nodes = 0;
+    for (int ty = 0; ty < tiles_y; ++ty) {
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            FloodTile tile;
+            tile.x0 = tx * tile_size;
+            tile.y0 = ty * tile_size;
+            tile.x1 = std::min(max_x, tile.x0 + tile_size) - 1;
+            tile.y1 = std::min(max_y, tile.y0 + tile_size) - 1;
+            tile.first_node = nodes;
+            nodes += tile.perimeter() + 1; // perimeter cells and the cells next to nodata
+            tiles.push_back(tile);
+        }
+    }
+
+    // flood every tile on its own
+    std::vector<std::vector<SpillEdge> > tile_edges(tiles.size());
+    std::vector<std::vector<std::pair<uint32_t, double> > > tile_outlets(tiles.size());
+    parallel_for((int)tiles.size(), threads, [&](int t) {
+        flood_tile<Queue>(input_raster, flow_direction, tiles[t], tiles, tiles_x, tile_size, tile_edges[t], tile_outlets[t], mask);
+    });
+
+    // spill graph in compressed adjacency form, in tile order so it does not depend on threads
+    std::vector<SpillEdge> edges;
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        edges.insert(edges.end(), tile_edges[t].begin(), tile_edges[t].end());
+        std::vector<SpillEdge>().swap(tile_edges[t]);
+    }
+    std::vector<uint64_t> first((size_t)nodes + 1, 0);
+    for (size_t e = 0; e < edges.size(); ++e) {
+        first[edges[e].u + 1]++;
+        first[edges[e].v + 1]++;
+    }
+    for (uint32_t n = 0; n < nodes; ++n)
+        first[n + 1] += first[n];
+    std::vector<uint64_t> adjacent(first[nodes]);
+    std::vector<uint64_t> fill(first.begin(), first.end() - 1);
+    for (size_t e = 0; e < edges.size(); ++e) {
+        adjacent[fill[edges[e].u]++] = e;
+        adjacent[fill[edges[e].v]++] = e;
+    }
+    std::vector<uint64_t>().swap(fill);
+
+    // priority flood over the roots from the outside
+    std::vector<double> level(nodes, HUGE_VAL);
+    std::vector<uint64_t> parent(nodes, OUTSIDE);
+    std::vector<char> done(nodes, 0);
+    std::priority_queue<FloodEntry> queue;
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        for (size_t o = 0; o < tile_outlets[t].size(); ++o) {
+            uint32_t node = tile_outlets[t][o].first;
+            level[node] = tile_outlets[t][o].second;
+            FloodEntry seed = { level[node], node, node };
+            queue.push(seed);
+        }
+    }
+    while (!queue.empty()) {
+        FloodEntry top = queue.top();
+        queue.pop();
+        if (done[top.id])
+            continue;
+        done[top.id] = 1;
+        for (uint64_t a = first[top.id]; a < first[top.id + 1]; ++a) {
+            const SpillEdge& edge = edges[adjacent[a]];
+            uint32_t other = edge.u == top.id ? edge.v : edge.u;
+            double reach = std::max(top.level, edge.weight);
+            if (!done[other] && reach < level[other]) {
+                level[other] = reach;
+                parent[other] = adjacent[a];
+                FloodEntry next = { reach, other, other };
+                queue.push(next);
+            }
+        }
+    }
+
+    // drain every tree through the spill it was reached by
+    parallel_for((int)tiles.size(), threads, [&](int t) {
+        const FloodTile& tile = tiles[t];
+        for (int k = 0; k < tile.perimeter(); ++k) {
+            uint32_t node = tile.first_node + k;
+            if (parent[node] == OUTSIDE)
+                continue;
+            const SpillEdge& edge = edges[parent[node]];
+            if (edge.v == node)
+                reroot_tree(flow_direction, edge.cell_v, edge.cell_u);
+            else
+                reroot_tree(flow_direction, edge.cell_u, edge.cell_v);
+        }
+    });
+}
+
+// Order the cells from the outlets upstream, the same way the serial flood hands them to the
+// accumulation (every cell after the cell it drains to)
+template <typename Store>
+void flow_order(const Raster<unsigned int, Store>& flow_direction, std::deque<CellPosition>& cells_to_process_accumulation,
+    const NodataMask* mask = NULL) {
+    int max_x = flow_direction.max_x, max_y = flow_direction.max_y;
+    for (int y = 0; y < max_y; ++y)
+        for (int x = 0; x < max_x; ++x)
+            if (flow_direction(x, y) == 0 && !is_masked(mask, x, y))
+                cells_to_process_accumulation.push_back(CellPosition(x, y));
+    for (size_t i = 0; i < cells_to_process_accumulation.size(); ++i) {
+        int cx = cells_to_process_accumulation[i].x, cy = cells_to_process_accumulation[i].y;
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                int x = cx + dx, y = cy + dy;
+                if ((dx == 0 && dy == 0) || x < 0 || y < 0 || x >= max_x || y >= max_y)
+                    continue;
+                int dir = flow_direction(x, y);
+                if (dir == flow_code(-dx, -dy))
+                    cells_to_process_accumulation.push_back(CellPosition(x, y));
+            }
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <deque>
+#include <algorithm>
+
+#include "raster.h"
+#include "cellsize.h"
+
+
+// Flow length along the flow directions, in the units of the CellSizes (metres for geographic
+// DEMs). The distance to the outlet of a cell is the length of its flow path down to where it
+// leaves the DEM, the longest flow path is the longest path from a source down to the cell.
+// The flood order has every cell after the cell it drains to, so walking it forwards hands the
+// distance to the outlet upstream and walking it backwards hands the longest path downstream,
+// one pass each with the step lengths looked up per row. At an outlet the longest flow path is
+// the one the time of concentration of its catchment is estimated from.
+// Distance to the outlet of every cell, walking the order forwards. visit(cell, down_x, down_y)
+// is called for every cell once its distance is set, with the cell it drains to or, for an
+// outlet, -1 -1, so other sums over the catchments can share the walk.
+template <typename DirStore, typename Visit>
+void distances_to_outlet(const std::deque<CellPosition>& cells_to_process_accumulation, const Raster<unsigned int, DirStore>& flow_direction,
+    const CellSizes& sizes, Raster<double>& to_outlet, Visit visit) {
+    to_outlet.set_layout(flow_direction.tile_shift);
+    to_outlet.reset(flow_direction.max_x, flow_direction.max_y);
+    to_outlet.fill();
+    for (auto cell = cells_to_process_accumulation.begin(); cell != cells_to_process_accumulation.end(); ++cell) {
+        int dir = flow_direction(cell->x, cell->y);
+        int down_x = cell->x, down_y = cell->y;
+        if (flow_target(dir, down_x, down_y))
+            to_outlet(cell->x, cell->y) = to_outlet(down_x, down_y) + sizes.step(cell->y, dir);
+        else
+            down_x = down_y = -1;
+        visit(*cell, down_x, down_y);
+    }
+}
+
+// Longest flow path from a source down to every cell, walking the order backwards
+template <typename DirStore>
+void longest_flow_paths(const std::deque<CellPosition>& cells_to_process_accumulation, const Raster<unsigned int, DirStore>& flow_direction,
+    const CellSizes& sizes, Raster<double>& longest) {
+    longest.set_layout(flow_direction.tile_shift);
+    longest.reset(flow_direction.max_x, flow_direction.max_y);
+    longest.fill();
+    for (auto cell = cells_to_process_accumulation.rbegin(); cell != cells_to_process_accumulation.rend(); ++cell) {
+        int dir = flow_direction(cell->x, cell->y);
+        int down_x = cell->x, down_y = cell->y;
+        if (flow_target(dir, down_x, down_y)) {
+            double length = longest(cell->x, cell->y) + sizes.step(cell->y, dir);
+            if (length > longest(down_x, down_y))
+                longest(down_x, down_y) = length;
+        }
+    }
+}
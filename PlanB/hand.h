@@ -0,0 +1,123 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "raster.h"
+#include "flood.h"
+#include "parallel.h"
+#include "cellsize.h"
+
+
+// Height above nearest drainage (HAND) and flow distance to the stream
+//
+// Every cell drains along its flow direction to a stream cell, a cell with at least threshold
+// cells upstream of it (the flow accumulation as a cell count). HAND is how high the cell lies
+// above that stream cell and the distance is the length of the flow path to it. Both are
+// handed down the flow path from the stream upstream: a cell takes the drainage elevation and
+// distance of the cell it drains to, plus its own step. The elevations are those of the DEM
+// filled along the directions, a cell at least as high as the cell it drains to, so HAND is
+// never negative. A flow path that leaves the DEM without passing a stream is measured from
+// its outlet, the stream continues beyond the edge.
+//
+// The outlets are independent of each other, so the catchments are processed in parallel:
+// each walks its cells from the outlet upstream, adds up the cell counts from the sources
+// down, then hands the drainage down from the outlet up.
+
+// Cells draining to one outlet in the order they are walked, with their values
+struct DrainageWalk {
+    std::vector<uint64_t> cells; // cell_id, every cell after the one it drains to
+    std::vector<uint32_t> down; // position in cells of the cell it drains to
+    std::vector<uint32_t> upstream; // cells upstream of the cell
+    std::vector<double> filled, drainage, distance;
+};
+
+// HAND and distance of the cells draining to the outlet at (outlet_x, outlet_y)
+template <typename Z, typename DirStore>
+void drainage_catchment(const Raster<Z>& input_raster, const Raster<unsigned int, DirStore>& flow_direction,
+    int outlet_x, int outlet_y, uint32_t threshold, const CellSizes& sizes,
+    Raster<float>& hand, Raster<float>& distance, DrainageWalk& walk) {
+    int max_x = flow_direction.max_x, max_y = flow_direction.max_y;
+    walk.cells.clear();
+    walk.down.clear();
+    walk.cells.push_back(flow_direction.cell_id(outlet_x, outlet_y));
+    walk.down.push_back(0);
+    for (size_t i = 0; i < walk.cells.size(); ++i) {
+        int cx = (int)(walk.cells[i] % max_x), cy = (int)(walk.cells[i] / max_x);
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                int x = cx + dx, y = cy + dy;
+                if ((dx == 0 && dy == 0) || x < 0 || y < 0 || x >= max_x || y >= max_y)
+                    continue;
+                if ((int)flow_direction(x, y) == flow_code(-dx, -dy)) {
+                    walk.cells.push_back(flow_direction.cell_id(x, y));
+                    walk.down.push_back((uint32_t)i);
+                }
+            }
+        }
+    }
+
+    size_t n = walk.cells.size();
+    walk.upstream.assign(n, 0);
+    for (size_t i = n - 1; i > 0; --i)
+        walk.upstream[walk.down[i]] += walk.upstream[i] + 1;
+
+    walk.filled.resize(n);
+    walk.drainage.resize(n);
+    walk.distance.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        int x = (int)(walk.cells[i] % max_x), y = (int)(walk.cells[i] / max_x);
+        double z = input_raster(x, y);
+        if (i == 0) {
+            walk.filled[i] = z;
+            walk.drainage[i] = z;
+            walk.distance[i] = 0;
+        }
+        else {
+            size_t d = walk.down[i];
+            walk.filled[i] = std::max(z, walk.filled[d]);
+            if (walk.upstream[i] >= threshold) {
+                walk.drainage[i] = walk.filled[i];
+                walk.distance[i] = 0;
+            }
+            else {
+                walk.drainage[i] = walk.drainage[d];
+                walk.distance[i] = walk.distance[d] + sizes.step(y, flow_direction(x, y));
+            }
+        }
+        hand(x, y) = (float)(walk.filled[i] - walk.drainage[i]);
+        distance(x, y) = (float)walk.distance[i];
+    }
+}
+
+// HAND and flow distance to the nearest stream of every cell of a flooded DEM, threads workers
+// (serial with 1). Cells in mask (nodata) are left at 0.
+template <typename Z, typename DirStore>
+void height_above_drainage(const Raster<Z>& input_raster, const Raster<unsigned int, DirStore>& flow_direction, const NodataMask* mask,
+    uint32_t threshold, const CellSizes& sizes, int threads, Raster<float>& hand, Raster<float>& distance) {
+    int max_x = flow_direction.max_x, max_y = flow_direction.max_y;
+    hand.set_layout(flow_direction.tile_shift);
+    hand.reset(max_x, max_y);
+    hand.fill();
+    distance.set_layout(flow_direction.tile_shift);
+    distance.reset(max_x, max_y);
+    distance.fill();
+
+    std::vector<uint64_t> outlets;
+    for (int y = 0; y < max_y; ++y)
+        for (int x = 0; x < max_x; ++x)
+            if (flow_direction(x, y) == 0 && !is_masked(mask, x, y))
+                outlets.push_back(flow_direction.cell_id(x, y));
+
+    // a few blocks of outlets per worker, each reusing one walk for all of its outlets; the
+    // outlets of a block are spread over the DEM so large catchments are shared out
+    int workers = std::max(1, threads);
+    size_t blocks = std::min(outlets.size(), (size_t)4 * workers);
+    parallel_for((int)blocks, workers, [&](int block) {
+        DrainageWalk walk;
+        for (size_t i = block; i < outlets.size(); i += blocks)
+            drainage_catchment(input_raster, flow_direction, (int)(outlets[i] % max_x), (int)(outlets[i] / max_x),
+                threshold, sizes, hand, distance, walk);
+    });
+}
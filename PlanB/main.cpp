@@ -3,199 +3,256 @@
 #include <stack>
 #include <cassert>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <cmath>
+#include <tuple>
+#include <limits>
+#include <type_traits>
 
 #include "gdal_priv.h"
 #include "cpl_conv.h"
+#include "cpl_string.h"
+
+#include "raster.h"
+#include "parallel.h"
+#include "accumulation.h"
+#include "flood.h"
+#include "mosaic.h"
+#include "upstream.h"
+#include "depression.h"
+#include "hand.h"
+#include "flowlength.h"
+#include "catchment.h"
+#include "upscale.h"
+#include "streams.h"
 
 
+// Write the values in a linked raster cell (useful for debugging)
+std::ostream& operator<<(std::ostream& os, const RasterCell& c) {
+    os << "{h=" << c.elevation << ", o=" << c.insertion_order << ", x=" << c.x << ", y=" << c.y << "}";
+    return os;
+};
 
-// A structure that links to a single cell in a Raster
-struct RasterCell {
-    int x, y; // row and column of the cell
-    int elevation;
-    int insertion_order;
-    bool add_to_list;
-    int flow_dir;
-    int accumulation = 0;
-
-    // Defines a new link to a cell
-    RasterCell(int x, int y, int elevation, int insert_order, int dir) {
-        this->x = x;
-        this->y = y;
-        this->elevation = elevation;
-        this->insertion_order = insert_order;
-        this->flow_dir = dir;
-    }
+// GDAL data type a raster of T is written as
+template <typename T> GDALDataType gdal_type() { return GDT_Int32; }
+template <> GDALDataType gdal_type<int16_t>() { return GDT_Int16; }
+template <> GDALDataType gdal_type<float>() { return GDT_Float32; }
+template <> GDALDataType gdal_type<double>() { return GDT_Float64; }
 
-    // Define the order of the linked cells (to be used in a priority_queue)
-    bool operator<(const RasterCell& other) const {
-        // to do with statements like if (this->elevation > other.elevation) return false/true;
-        if (this->elevation == other.elevation)
-        {
-            if (this->insertion_order < other.insertion_order)
-                return false;
-            else if (this->insertion_order > other.insertion_order)
-                return true;
-        }
-        else if (this->elevation <= other.elevation)
-            return false;
-        else if (this->elevation > other.elevation)
-            return true;
-       
-    }
+// Georeferencing of a DEM, copied to the rasters written for it
+struct GeoReference {
+    double transform[6];
+    std::string projection;
 };
 
-// Storage and access of a raster of a given size
-struct Raster {
-    std::vector<unsigned int> pixels; // where everything is stored
-    std::vector<int> visiting; // store information about if the cell is visited
-    std::vector<int> in_queue; // store information about if the cell is added to the priority queue
+// How the output rasters are written
+struct OutputFormat {
+    bool cog = false; // cloud optimized GeoTIFF instead of a plain striped GeoTIFF
+    int threads = 0; // threads compressing the tiles of a COG, 0 for all CPUs
+};
 
+// write raster result into the tiff file. A COG is first staged in a temporary tiled GTiff
+// next to it (on disk, so the raster is not held a second time in memory) and then copied by
+// the COG driver, which cuts it into 512 x 512 tiles, compresses them with DEFLATE on
+// format.threads threads, writes them in order and adds the overviews in the same pass. The
+// staging file has the same tiles, so the copy reads each of them once, and is deleted after.
+// Overviews take the nearest cell, so they only hold real direction codes and accumulations.
+template <typename T, typename Store>
+bool output_tiff(std::string filename, const Raster<T, Store>& input_raster, int max_x, int max_y, const GeoReference& geo,
+    const OutputFormat& format = OutputFormat()) {
 
-    int max_x, max_y; // number of columns and rows
-    int direction;
-    
+    int nXSize = max_x;
+    int nYSize = max_y;
+    GDALDataset* geotiffDataset;
+    GDALDriver* driverGeotiff;
 
-    // Initialise a raster with x columns and y rows
-    Raster(int x, int y) {
-        max_x = x;
-        max_y = y;
-        unsigned int total_pixels = x * y;
-        pixels.reserve(total_pixels);
-        visiting.reserve(total_pixels);
-        
+    std::string staging = format.cog ? filename + ".staging.tif" : filename;
+    char** create_options = NULL;
+    if (format.cog) {
+        create_options = CSLSetNameValue(create_options, "TILED", "YES");
+        create_options = CSLSetNameValue(create_options, "BLOCKXSIZE", "512");
+        create_options = CSLSetNameValue(create_options, "BLOCKYSIZE", "512");
+        create_options = CSLSetNameValue(create_options, "BIGTIFF", "IF_SAFER");
     }
-
-    // Fill values of an entire row
-    void add_scanline(const unsigned int* line) {
-        for (int i = 0; i < max_x; ++i)
-            pixels.push_back(line[i]);
+    driverGeotiff = GetGDALDriverManager()->GetDriverByName("GTiff");
+    geotiffDataset = driverGeotiff->Create(staging.c_str(), nXSize, nYSize, 1, gdal_type<T>(), create_options);
+    CSLDestroy(create_options);
+    if (geotiffDataset == NULL) {
+        std::cerr << "Couldn't create " << staging << std::endl;
+        return false;
     }
-
-    // Fill entire raster with zeros
-    void fill() {
-        unsigned int total_pixels = max_x * max_y;
-        for (int i = 0; i < total_pixels; ++i)
-        {
-            pixels.push_back(0);
+    double geo_transform[6];
+    std::copy(geo.transform, geo.transform + 6, geo_transform);
+    geotiffDataset->SetGeoTransform(geo_transform);
+    geotiffDataset->SetProjection(geo.projection.c_str());
+
+    // rows are copied out of the raster here and written by a writer thread, a block of rows
+    // at a time through a short queue, so copying the next block overlaps writing (and
+    // compressing) the previous one
+    const int block_rows = 64;
+    GDALRasterBand* band = geotiffDataset->GetRasterBand(1);
+    BoundedQueue<std::pair<int, std::vector<T> > > blocks(2);
+    bool write_failed = false;
+    std::thread writer([&]() {
+        std::pair<int, std::vector<T> > block;
+        while (blocks.pop(block)) {
+            int rows = (int)(block.second.size() / nXSize);
+            if (band->RasterIO(GF_Write, 0, block.first, nXSize, rows, block.second.data(), nXSize, rows, gdal_type<T>(), 0, 0) != CE_None)
+                write_failed = true;
         }
-    }
-
-    // Fill the entire raster with 0 in visiting and in_queue vector
-    void fill_visit() {
-        unsigned int total_pixels = max_x * max_y;
-        for (int i = 0; i < total_pixels; ++i)
-        {
-            visiting.push_back(0);
-            in_queue.push_back(0);
+    });
+    for (int j0 = 0; j0 < nYSize; j0 += block_rows) {
+        int rows = std::min(block_rows, nYSize - j0);
+        std::vector<T> rowBuff((size_t)rows * nXSize);
+        for (int j = j0; j < j0 + rows; j++) {
+            for (int i = 0; i < nXSize; i++) {
+                rowBuff[(size_t)(j - j0) * nXSize + i] = input_raster(i, j);
+            }
         }
+        blocks.push(std::make_pair(j0, std::move(rowBuff)));
     }
-
-
-    // Access the value of a raster cell to read or write it
-    unsigned int& operator()(int x, int y) {
-        assert(x >= 0 && x < max_x);
-        assert(y >= 0 && y < max_y);
-        return pixels[x + y * max_x];
-    }
-
-    // Access the value of a raster cell to read it
-    unsigned int operator()(int x, int y) const {
-        assert(x >= 0 && x < max_x);
-        assert(y >= 0 && y < max_y);
-        return pixels[x + y * max_x];
-    }
-
-    // Add pixel value for output raster
-    void add_value(int x1, int y1, int value) {
-        assert(x1 >= 0 && x1 < max_x);
-        assert(y1 >= 0 && y1 < max_y);
-        pixels[x1 + y1 * max_x] = value;
-        
-    }
-
-    //change the status from unvisited to visited
-    void Is_Visited(int x1, int y1) {
-        visiting[x1 + y1 * max_x] = 1;
+    blocks.close();
+    writer.join();
+    if (write_failed) {
+        std::cerr << "Couldn't write " << staging << std::endl;
+        GDALClose(geotiffDataset);
+        if (format.cog)
+            driverGeotiff->Delete(staging.c_str());
+        return false;
     }
 
-    // return the status of the pixel whether visited.
-    int If_Visited(int x1, int y1) {
-        return visiting[x1 + y1 * max_x];
+    if (format.cog) {
+        GDALDriver* driverCog = GetGDALDriverManager()->GetDriverByName("COG");
+        if (driverCog == NULL) {
+            std::cerr << "GDAL has no COG driver (3.1 or later needed) to write " << filename << std::endl;
+            GDALClose(geotiffDataset);
+            driverGeotiff->Delete(staging.c_str());
+            return false;
+        }
+        std::string threads = format.threads > 0 ? std::to_string(format.threads) : "ALL_CPUS";
+        char** cog_options = NULL;
+        cog_options = CSLSetNameValue(cog_options, "COMPRESS", "DEFLATE");
+        cog_options = CSLSetNameValue(cog_options, "PREDICTOR", "YES");
+        cog_options = CSLSetNameValue(cog_options, "BLOCKSIZE", "512");
+        cog_options = CSLSetNameValue(cog_options, "NUM_THREADS", threads.c_str());
+        cog_options = CSLSetNameValue(cog_options, "OVERVIEWS", "AUTO");
+        cog_options = CSLSetNameValue(cog_options, "OVERVIEW_RESAMPLING", "NEAREST");
+        cog_options = CSLSetNameValue(cog_options, "BIGTIFF", "IF_SAFER");
+        GDALDataset* cogDataset = driverCog->CreateCopy(filename.c_str(), geotiffDataset, FALSE, cog_options, NULL, NULL);
+        CSLDestroy(cog_options);
+        GDALClose(geotiffDataset);
+        driverGeotiff->Delete(staging.c_str());
+        if (cogDataset == NULL) {
+            std::cerr << "Couldn't write " << filename << std::endl;
+            return false;
+        }
+        GDALClose(cogDataset);
+        return true;
     }
 
-    // update the status after add to the cell_to_process_flow queue
-    void Add_to_queue(int x, int y) {
-        in_queue[x + y * max_x] = 1;
-    }
+    GDALClose(geotiffDataset);
+    return true;
+}
 
-    // check the status whether add to the cell_to_process_flow queue
-    int If_add_to_queue(int x, int y) {
-        return in_queue[x + y * max_x];
+// Read the first band of a raster matching the DEM size as T (rainfall, runoff coefficient, loss, directions)
+template <typename T>
+bool read_raster(const char* filename, int nXSize, int nYSize, Raster<T>& raster) {
+    GDALDataset* dataset = (GDALDataset*)GDALOpen(filename, GA_ReadOnly);
+    if (dataset == NULL) {
+        std::cerr << "Couldn't open file " << filename << std::endl;
+        return false;
     }
-
-    void output_accumulation(int& current_line, unsigned int* line)
-    {
-        for (int i = 0; i < max_y; ++i) 
-            line[i] = pixels[i + current_line * max_y];
+    if (dataset->GetRasterXSize() != nXSize || dataset->GetRasterYSize() != nYSize) {
+        std::cerr << filename << " is " << dataset->GetRasterXSize() << "x" << dataset->GetRasterYSize()
+            << ", expected " << nXSize << "x" << nYSize << std::endl;
+        GDALClose(dataset);
+        return false;
     }
-};
-
-// global variant insert order
-int insert_order = 0;
-
-// Write the values in a linked raster cell (useful for debugging)
-std::ostream& operator<<(std::ostream& os, const RasterCell& c) {
-    os << "{h=" << c.elevation << ", o=" << c.insertion_order << ", x=" << c.x << ", y=" << c.y << "}";
-    return os;
-};
-
-// write raster result into the tiff file
-void output_tiff(std::string filename, Raster input_raster,int max_x, int max_y) {
-
-    int nXSize = max_x;
-    int nYSize = max_y;
-    double geo_transform[6];
-    std::string tiffname = filename;
-    GDALAllRegister();
-    CPLPushErrorHandler(CPLQuietErrorHandler);
-    GDALDataset* gribDataset, * geotiffDataset;
-    GDALDriver* driverGeotiff;
-    GDALRasterBand* geotiffBand;
-    
-    gribDataset = (GDALDataset*)GDALOpen("N36E076.hgt", GA_ReadOnly);
-    gribDataset->GetGeoTransform(geo_transform);
-
-    driverGeotiff = GetGDALDriverManager()->GetDriverByName("GTiff");
-    geotiffDataset = driverGeotiff->Create(tiffname.c_str(), nXSize, nYSize, 1, GDT_Int32, NULL);
-    geotiffDataset->SetGeoTransform(geo_transform);
-    geotiffDataset->SetProjection(gribDataset->GetProjectionRef());
-    unsigned int* rowBuff = (unsigned int*)CPLMalloc(sizeof(unsigned int) * nYSize);
-
-    for (int j = 0; j < nYSize; j++) {
-        for (int i = 0; i < nXSize; i++) {
-            rowBuff[i] = (unsigned int)input_raster(i, j);
+    T* scanline = (T*)CPLMalloc(sizeof(T) * nXSize);
+    raster.fill();
+    for (int current_scanline = 0; current_scanline < nYSize; ++current_scanline) {
+        if (dataset->GetRasterBand(1)->RasterIO(GF_Read, 0, current_scanline, nXSize, 1,
+            scanline, nXSize, 1, gdal_type<T>(), 0, 0) != CPLE_None) {
+            std::cerr << "Couldn't read scanline " << current_scanline << " of " << filename << std::endl;
+            CPLFree(scanline);
+            GDALClose(dataset);
+            return false;
         }
-        geotiffDataset->GetRasterBand(1)->RasterIO(GF_Write, 0, j, nYSize, 1, rowBuff, nYSize, 1, GDT_Int32, 0, 0);
+        for (int i = 0; i < nXSize; ++i)
+            raster(i, current_scanline) = scanline[i];
     }
+    CPLFree(scanline);
+    GDALClose(dataset);
+    return true;
+}
 
-    GDALClose(gribDataset);
-    GDALClose(geotiffDataset);
-    GDALDestroyDriverManager();
+// Calculate flow accumulation as T with the given weight source and write it out
+template <typename T, typename Store = RasterVector<T>, typename Weight, typename DirStore>
+bool write_accumulation(const std::deque<CellPosition>& cells_to_process_accumulation, const Raster<unsigned int, DirStore>& flow_direction,
+    const Weight& weight, int nXSize, int nYSize, const std::string& filename, const GeoReference& geo, const OutputFormat& format) {
+    Raster<T, Store> flow_accumulation(nXSize, nYSize);
+    flow_accumulation.set_layout(flow_direction.tile_shift);
+    flow_accumulation.fill();
+    accumulate_flow(cells_to_process_accumulation, flow_direction, flow_accumulation, weight);
+    return output_tiff(filename, flow_accumulation, nXSize, nYSize, geo, format);
 }
 
+// Options of a run, the same for every DEM of a batch
+struct RunOptions {
+    const char* rainfall_file = NULL; // optional weighted accumulation: rainfall x runoff coefficient with per cell loss
+    const char* runoff_file = NULL;
+    const char* loss_file = NULL;
+    std::string accumulation_type = "count"; // accumulated as float or double instead of cell counts
+    int threads = 0; // serial flood unless a thread count is given
+    int tile_size = 1024;
+    std::string queue_type = "bucket";
+    std::string storage = "plain"; // compact: directions in 4 (serial) or 8 bits and counts in one byte per cell
+    OutputFormat output;
+    int tile_shift = 0; // layout of the DEM, directions and accumulation, see Raster
+    std::string checkpoint_file; // serial flood only: checkpoint written every checkpoint_interval seconds
+    double checkpoint_interval = 300;
+    bool resume = false; // carry on from checkpoint_file when it holds a checkpoint of the DEM
+    std::string upstream_index; // file the upstream index of the directions is written to, see upstream.h
+    bool depressions = false; // write the depression hierarchy, see depression.h
+    std::vector<double> fsm_depths; // rain depths routed through the depressions, one water depth raster each
+    uint32_t hand_threshold = 0; // cells upstream of a stream cell, HAND and distance to stream are written when set
+    bool flow_length = false; // write the distance to the outlet and the longest flow path
+    bool catchments = false; // write the statistics of the catchment of every outlet, see catchment.h
+    std::vector<int> upscale_factors; // coarse grids of factor x factor cells the directions are traced to, see upscale.h
+    std::vector<uint32_t> stream_thresholds; // stream networks swept from one sorted index, see streams.h
+    bool stream_masks = false; // also write the stream cells of every threshold
+};
 
-int main(int argc, const char* argv[]) {
-    // Open dataset
-    GDALDataset* input_dataset;
-    GDALAllRegister();
-    input_dataset = (GDALDataset*)GDALOpen("N36E076.hgt", GA_ReadOnly);
-    if (input_dataset == NULL) {
-        std::cerr << "Couldn't open file" << std::endl;
-        return 1;
+// Memory a worker keeps from one DEM to the next, so a batch of equally sized tiles does not
+// allocate the large rasters again for every tile. DirStore is the storage of the directions.
+template <typename DirStore = RasterVector<unsigned int> >
+struct TileBuffers {
+    // the DEM, in the raster of the elevation type it is read as (see read_dem)
+    std::tuple<Raster<int16_t>, Raster<int32_t>, Raster<float>, Raster<double> > elevations;
+    Raster<unsigned int, DirStore> flow_direction{ 0, 0 };
+    NodataMask mask; // cells of the DEM equal to its NODATA value
+    std::deque<CellPosition> cells_to_process_accumulation;
+
+    // Store the next DEMs and their directions in rows (0) or tiles, see Raster::set_layout
+    void set_layout(int tile_shift) {
+        std::get<Raster<int16_t> >(elevations).set_layout(tile_shift);
+        std::get<Raster<int32_t> >(elevations).set_layout(tile_shift);
+        std::get<Raster<float> >(elevations).set_layout(tile_shift);
+        std::get<Raster<double> >(elevations).set_layout(tile_shift);
+        flow_direction.set_layout(tile_shift);
     }
+};
 
-    // Print dataset info
+// Print the driver, size, georeferencing and band 1 of a dataset
+void print_info(GDALDataset* input_dataset) {
     double geo_transform[6];
     std::cout << "Driver: " << input_dataset->GetDriver()->GetDescription() << "/" << input_dataset->GetDriver()->GetMetadataItem(GDAL_DMD_LONGNAME) << std::endl;;
     std::cout << "Size is " << input_dataset->GetRasterXSize() << "x" << input_dataset->GetRasterYSize() << "x" << input_dataset->GetRasterCount() << std::endl;
@@ -218,587 +275,885 @@ int main(int argc, const char* argv[]) {
     if (!(bGotMin && bGotMax))
         GDALComputeRasterMinMax((GDALRasterBandH)input_band, TRUE, adfMinMax);
     std::cout << "Min=" << adfMinMax[0] << " Max=" << adfMinMax[1] << std::endl;
+}
 
-    // Read Band 1 line by line
+// Read band 1 of an open DEM as Z into input_raster and mask its NODATA cells, then close it
+template <typename Z>
+bool read_elevations(GDALDataset* input_dataset, const std::string& dem_file, Raster<Z>& input_raster, NodataMask& mask, bool verbose) {
+    GDALRasterBand* input_band = input_dataset->GetRasterBand(1);
     int nXSize = input_band->GetXSize();
     int nYSize = input_band->GetYSize();
-    Raster input_raster(nXSize, nYSize);
+    input_raster.reset(nXSize, nYSize);
+    input_raster.pixels.resize(input_raster.cell_count());
+    // rows are read straight into the raster, through a scanline for the tiled layout
+    std::vector<Z> scanline(input_raster.tile_shift != 0 ? nXSize : 0);
     for (int current_scanline = 0; current_scanline < nYSize; ++current_scanline) {
-        unsigned int* scanline = (unsigned int*)CPLMalloc(sizeof(unsigned int) * nXSize);
+        Z* line = input_raster.tile_shift != 0 ? scanline.data() : &input_raster.pixels[input_raster.index(0, current_scanline)];
         if (input_band->RasterIO(GF_Read, 0, current_scanline, nXSize, 1,
-            scanline, nXSize, 1, GDT_Int32,
+            line, nXSize, 1, gdal_type<Z>(),
             0, 0) != CPLE_None) {
-            std::cerr << "Couldn't read scanline " << current_scanline << std::endl;
-            return 1;
-        } input_raster.add_scanline(scanline);
-        CPLFree(scanline);
+            std::cerr << "Couldn't read scanline " << current_scanline << " of " << dem_file << std::endl;
+            GDALClose(input_dataset);
+            return false;
+        }
+        if (input_raster.tile_shift != 0)
+            for (int i = 0; i < nXSize; ++i)
+                input_raster(i, current_scanline) = scanline[i];
+    }
+    // a NODATA value Z can't hold matches no cell
+    int has_nodata = 0;
+    double nodata = input_band->GetNoDataValue(&has_nodata);
+    bool fits = nodata != nodata ? std::is_floating_point<Z>::value
+        : nodata >= (double)std::numeric_limits<Z>::lowest() && nodata <= (double)std::numeric_limits<Z>::max() && (double)(Z)nodata == nodata;
+    if (has_nodata && fits)
+        mask.build(input_raster, (Z)nodata);
+    else
+        mask.clear();
+    GDALClose(input_dataset);
+
+    if (verbose)
+        std::cout << "Created raster: " << input_raster.max_x << "x" << input_raster.max_y << " = " << (size_t)input_raster.max_x * input_raster.max_y << std::endl;
+    return true;
+}
+
+// Read band 1 of a DEM into the raster of buffers.elevations for its data type and its
+// georeferencing into geo, then return process(input_raster). Byte and 16 bit integer bands
+// (SRTM) are read as int16, wider integers as int32, Float32 (LiDAR) as float and the rest as
+// double, so every elevation keeps its exact value in the smallest type that holds it.
+// verbose prints what the single DEM run always printed.
+template <typename Buffers, typename Process>
+bool read_dem(const std::string& dem_file, Buffers& buffers, GeoReference& geo, bool verbose, Process process) {
+    // Open dataset
+    GDALDataset* input_dataset;
+    input_dataset = (GDALDataset*)GDALOpen(dem_file.c_str(), GA_ReadOnly);
+    if (input_dataset == NULL) {
+        std::cerr << "Couldn't open file " << dem_file << std::endl;
+        return false;
+    }
+    if (verbose)
+        print_info(input_dataset);
+    if (input_dataset->GetGeoTransform(geo.transform) != CE_None) {
+        double identity[6] = { 0, 1, 0, 0, 0, 1 };
+        std::copy(identity, identity + 6, geo.transform);
+    }
+    if (input_dataset->GetProjectionRef() != NULL)
+        geo.projection = input_dataset->GetProjectionRef();
+
+    switch (input_dataset->GetRasterBand(1)->GetRasterDataType()) {
+    case GDT_Byte:
+    case GDT_Int16: {
+        Raster<int16_t>& input_raster = std::get<Raster<int16_t> >(buffers.elevations);
+        return read_elevations(input_dataset, dem_file, input_raster, buffers.mask, verbose) && process(input_raster);
+    }
+    case GDT_UInt16:
+    case GDT_Int32:
+    case GDT_UInt32: {
+        Raster<int32_t>& input_raster = std::get<Raster<int32_t> >(buffers.elevations);
+        return read_elevations(input_dataset, dem_file, input_raster, buffers.mask, verbose) && process(input_raster);
+    }
+    case GDT_Float32: {
+        Raster<float>& input_raster = std::get<Raster<float> >(buffers.elevations);
+        return read_elevations(input_dataset, dem_file, input_raster, buffers.mask, verbose) && process(input_raster);
     }
+    default: {
+        Raster<double>& input_raster = std::get<Raster<double> >(buffers.elevations);
+        return read_elevations(input_dataset, dem_file, input_raster, buffers.mask, verbose) && process(input_raster);
+    }
+    }
+}
 
-    std::cout << "Created raster: " << input_raster.max_x << "x" << input_raster.pixels.size() / input_raster.max_y << " = " << input_raster.pixels.size() << std::endl;
-    Raster flow_direction(input_raster.max_x, input_raster.max_y);
+// Flood input_raster into buffers.flow_direction and the accumulation order
+template <typename Z, typename DirStore>
+void flood_dem(const RunOptions& options, const Raster<Z>& input_raster, TileBuffers<DirStore>& buffers) {
+    int nXSize = input_raster.max_x, nYSize = input_raster.max_y;
+    Raster<unsigned int, DirStore>& flow_direction = buffers.flow_direction;
+    flow_direction.reset(nXSize, nYSize);
     flow_direction.fill();
     flow_direction.fill_visit();
 
-    std::priority_queue<RasterCell, std::deque<RasterCell>> cells_to_process_flow;
-    std::deque<RasterCell> cells_to_process_accumulation;
-
-    //add the cell on the boundary(the first and the last row) and choose the initial pixel
-    for (int i = 0; i < nXSize; i++)
-    {
-        int elevation1 = input_raster(i, 0);
-        cells_to_process_flow.push(RasterCell(i, 0, elevation1, insert_order, 0));
-        insert_order++;
-        flow_direction.Add_to_queue(i, 0);
-
-        int elevation2 = input_raster(i, nXSize - 1);
-        cells_to_process_flow.push(RasterCell(i, nYSize - 1, elevation2, insert_order, 0));
-        flow_direction.Add_to_queue(i, nYSize - 1);
-        insert_order++;
-    }
-
-    //add the cell on the boundary(the first and the last column) and choose the initial pixel
-    for (int j = 1; j < nYSize - 1; j++)
-    {
-        int elevation3 = input_raster(0, j);
-        cells_to_process_flow.push(RasterCell(0, j, elevation3, insert_order, 0));
-        flow_direction.Add_to_queue(0, j);
-        insert_order++;
-
-        int elevation4 = input_raster(nXSize - 1, j);
-        cells_to_process_flow.push(RasterCell(nXSize - 1, j, elevation4, insert_order, 0));
-        flow_direction.Add_to_queue(nXSize - 1, j);
-        insert_order++;
-    }
-
-    //select the lowest elevation cell in the priority queue
-    RasterCell start_raster = cells_to_process_flow.top();
-
-    while (cells_to_process_flow.empty() != true)
-    {
-        // calculate neighbours direction for top_left cell
-        start_raster = cells_to_process_flow.top();
-        if (start_raster.x == 0 && start_raster.y == 0) {
-            if (flow_direction(start_raster.x + 1, start_raster.y) == 0) 
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y) == 0) 
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y, input_raster(start_raster.x + 1, start_raster.y), insert_order, 40));
-                    insert_order++;
-                } 
-                flow_direction(start_raster.x + 1, start_raster.y) = 40;
-            }
-            if (flow_direction(start_raster.x, start_raster.y + 1) == 0) 
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y + 1) == 0) {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y + 1, input_raster(start_raster.x, start_raster.y + 1), insert_order, 20));
-                    insert_order++;
-                } 
-                flow_direction(start_raster.x, start_raster.y + 1) = 20;
-            }
-            if (flow_direction(start_raster.x + 1, start_raster.y + 1) == 0) 
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y + 1) == 0) {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y + 1, input_raster(start_raster.x + 1, start_raster.y + 1), insert_order, 10));
-                    insert_order++;
-                } 
-                flow_direction(start_raster.x + 1, start_raster.y + 1) = 10;
-            }
+    // integer elevations go through a bucket queue unless their range is too wide, floating
+    // point elevations always through the heap
+    std::string queue_type = options.queue_type;
+    double min_elevation, max_elevation;
+    const NodataMask* mask = buffers.mask.empty() ? NULL : &buffers.mask;
+    elevation_range(input_raster, 0, 0, nXSize - 1, nYSize - 1, min_elevation, max_elevation, mask);
+    if (!std::is_integral<Z>::value) {
+        queue_type = "heap";
+    }
+    else if (queue_type == "bucket" && !bucket_range_ok(min_elevation, max_elevation)) {
+        std::cout << "Elevations " << min_elevation << " to " << max_elevation << " are too far apart for the bucket queue, using the heap" << std::endl;
+        queue_type = "heap";
+    }
+
+    std::deque<CellPosition>& cells_to_process_accumulation = buffers.cells_to_process_accumulation;
+    cells_to_process_accumulation.clear();
+    // packed directions share bytes between cells and are only written by the serial flood
+    if constexpr (!store_shares_bytes<DirStore>::value) {
+        if (options.threads > 0) {
+            if (queue_type == "bucket")
+                flood_parallel<BucketQueue>(input_raster, flow_direction, options.tile_size, options.threads, mask);
+            else
+                flood_parallel<HeapQueue>(input_raster, flow_direction, options.tile_size, options.threads, mask);
+            flow_order(flow_direction, cells_to_process_accumulation, mask);
+            return;
         }
+    }
+    FloodCheckpoint checkpoint;
+    FloodCheckpoint* used_checkpoint = NULL;
+    if (!options.checkpoint_file.empty()) {
+        checkpoint.filename = options.checkpoint_file;
+        checkpoint.interval = options.checkpoint_interval;
+        if (open_checkpoint(checkpoint, input_raster, options.resume, flow_direction, cells_to_process_accumulation))
+            used_checkpoint = &checkpoint;
+    }
+    if (queue_type == "bucket") {
+        flood_serial<BucketQueue>(input_raster, flow_direction, cells_to_process_accumulation, mask, used_checkpoint);
+    }
+    else {
+        flood_serial<HeapQueue>(input_raster, flow_direction, cells_to_process_accumulation, mask, used_checkpoint);
+    }
+}
 
-        // calculate neighbours direction for center cells
-        else if (start_raster.x > 0 && start_raster.x < nXSize - 1 && start_raster.y>0 && start_raster.y < nYSize - 1)
-        {
-            if (flow_direction(start_raster.x + 1, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y + 1, input_raster(start_raster.x + 1, start_raster.y + 1), insert_order, 10));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y + 1) = 10;
-            }
-            if (flow_direction(start_raster.x - 1, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y + 1, input_raster(start_raster.x - 1, start_raster.y + 1), insert_order, 30));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y + 1) = 30;
-            }
-            if (flow_direction(start_raster.x, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y + 1, input_raster(start_raster.x, start_raster.y + 1), insert_order, 20));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x, start_raster.y + 1) = 20;
-            }
-            if (flow_direction(start_raster.x + 1, start_raster.y) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y, input_raster(start_raster.x + 1, start_raster.y), insert_order, 40));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y) = 40;
-            }
-            if (flow_direction(start_raster.x - 1, start_raster.y) == 0) {
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y, input_raster(start_raster.x - 1, start_raster.y), insert_order, 50));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y) = 50;
-            }
-            if (flow_direction(start_raster.x + 1, start_raster.y - 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y - 1, input_raster(start_raster.x + 1, start_raster.y - 1), insert_order, 60));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y - 1) = 60;
-            }
+// Write the flow directions and accumulation of a flooded DEM to output_prefix +
+// flow_direction.tif and flow_accumulation.tif. Cell counts are kept in a CountStore.
+template <typename DirStore, typename CountStore>
+bool write_dem_outputs(const std::string& output_prefix, const RunOptions& options, TileBuffers<DirStore>& buffers,
+    const GeoReference& geo, bool verbose) {
+    Raster<unsigned int, DirStore>& flow_direction = buffers.flow_direction;
+    int nXSize = flow_direction.max_x, nYSize = flow_direction.max_y;
+    std::deque<CellPosition>& cells_to_process_accumulation = buffers.cells_to_process_accumulation;
+
+    // the directions are written on a thread of their own while the accumulation is computed
+    bool direction_written = false;
+    std::thread direction_writer([&]() {
+        direction_written = output_tiff(output_prefix + "flow_direction.tif", flow_direction, nXSize, nYSize, geo, options.output);
+    });
+
+    auto accumulate = [&]() {
+        // calculate flow accumulation base on the flow direction and output it
+        std::string accumulation_file = output_prefix + "flow_accumulation.tif";
+        bool written;
+        if (options.accumulation_type == "count") {
+            written = write_accumulation<unsigned int, CountStore>(cells_to_process_accumulation, flow_direction, UnitWeight(), nXSize, nYSize, accumulation_file, geo, options.output);
+        }
+        else {
+            Raster<float> rainfall(nXSize, nYSize), runoff(nXSize, nYSize), loss(nXSize, nYSize);
+            if (options.rainfall_file != NULL && !read_raster(options.rainfall_file, nXSize, nYSize, rainfall))
+                return false;
+            if (options.runoff_file != NULL && !read_raster(options.runoff_file, nXSize, nYSize, runoff))
+                return false;
+            if (options.loss_file != NULL && !read_raster(options.loss_file, nXSize, nYSize, loss))
+                return false;
+            RunoffWeight weight(&rainfall, options.runoff_file != NULL ? &runoff : NULL, options.loss_file != NULL ? &loss : NULL);
+            if (options.rainfall_file == NULL && options.accumulation_type == "double")
+                written = write_accumulation<double>(cells_to_process_accumulation, flow_direction, UnitWeight(), nXSize, nYSize, accumulation_file, geo, options.output);
+            else if (options.rainfall_file == NULL)
+                written = write_accumulation<float>(cells_to_process_accumulation, flow_direction, UnitWeight(), nXSize, nYSize, accumulation_file, geo, options.output);
+            else if (options.accumulation_type == "double")
+                written = write_accumulation<double>(cells_to_process_accumulation, flow_direction, weight, nXSize, nYSize, accumulation_file, geo, options.output);
+            else
+                written = write_accumulation<float>(cells_to_process_accumulation, flow_direction, weight, nXSize, nYSize, accumulation_file, geo, options.output);
+        }
+        return written;
+    };
+    bool written = accumulate();
+    direction_writer.join();
+    if (!direction_written)
+        return false;
+    if (verbose)
+        std::cout << "finish output flow direction tiff file" << std::endl;
+    if (written && verbose)
+        std::cout << "finish output flow_accumulation tiff file" << std::endl;
+    return written;
+}
 
-            if (flow_direction(start_raster.x, start_raster.y - 1) == 0) {
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y - 1, input_raster(start_raster.x, start_raster.y - 1), insert_order, 70));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x, start_raster.y - 1) = 70;
+// Depression hierarchy of a DEM written to output_prefix + depressions.csv, and the water left
+// standing by every rain depth of options.fsm_depths to output_prefix + water_<depth>.tif
+template <typename Z>
+bool write_depression_outputs(const std::string& output_prefix, const RunOptions& options, const Raster<Z>& input_raster,
+    const NodataMask* mask, const GeoReference& geo, bool verbose) {
+    int nXSize = input_raster.max_x, nYSize = input_raster.max_y;
+    auto start = std::chrono::steady_clock::now();
+    // the same queue as the flood, see flood_dem
+    double min_elevation, max_elevation;
+    elevation_range(input_raster, 0, 0, nXSize - 1, nYSize - 1, min_elevation, max_elevation, mask);
+    DepressionHierarchy hierarchy;
+    if (std::is_integral<Z>::value && options.queue_type == "bucket" && bucket_range_ok(min_elevation, max_elevation))
+        build_depressions<BucketQueue>(input_raster, mask, hierarchy);
+    else
+        build_depressions<HeapQueue>(input_raster, mask, hierarchy);
+    if (verbose)
+        std::cout << hierarchy.depressions.size() - 1 << " depressions in "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+    if (options.depressions && !write_depressions(output_prefix + "depressions.csv", hierarchy))
+        return false;
+    if (options.fsm_depths.empty())
+        return true;
+
+    FillSpillMerge fsm(hierarchy);
+    Raster<float> water(nXSize, nYSize);
+    for (size_t i = 0; i < options.fsm_depths.size(); ++i) {
+        double depth = options.fsm_depths[i];
+        start = std::chrono::steady_clock::now();
+        fsm.run(depth);
+        std::vector<double> level;
+        fsm.levels(level);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double stored = 0;
+        for (size_t d = 1; d < level.size(); ++d)
+            if (hierarchy.depressions[d].parent == OCEAN)
+                stored += fsm.water[d];
+        if (verbose)
+            std::cout << "rain " << depth << ": " << stored << " stored, " << fsm.outflow << " flows out, " << seconds << " s" << std::endl;
+        for (int y = 0; y < nYSize; ++y) {
+            for (int x = 0; x < nXSize; ++x) {
+                uint32_t d = hierarchy.label[input_raster.cell_id(x, y)];
+                water(x, y) = d == OCEAN || d == NO_DEPRESSION ? 0.0f : (float)std::max(0.0, level[d] - input_raster(x, y));
             }
-            if (flow_direction(start_raster.x - 1, start_raster.y - 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y - 1, input_raster(start_raster.x - 1, start_raster.y - 1), insert_order, 80));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y - 1) = 80;
-            }
-
         }
-        // calculate neighbours direction for top_right cell
-        else if (start_raster.x == nXSize - 1 && start_raster.y == 0)
-        {
-            if (flow_direction(start_raster.x - 1, start_raster.y) == 0) {
-
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y, input_raster(start_raster.x - 1, start_raster.y), insert_order, 50));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y) = 50;
-            }
-            if (flow_direction(start_raster.x, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y + 1, input_raster(start_raster.x, start_raster.y + 1), insert_order, 20));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x, start_raster.y + 1) = 20;
-            }
-            if (flow_direction(start_raster.x - 1, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y + 1, input_raster(start_raster.x - 1, start_raster.y + 1), insert_order, 30));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y + 1) = 30;
-            }
+        std::ostringstream name;
+        name << output_prefix << "water_" << depth << ".tif";
+        if (!output_tiff(name.str(), water, nXSize, nYSize, geo, options.output))
+            return false;
+    }
+    return true;
+}
 
-        }
-        // calculate neighbours direction for bottom left cell
-        else if (start_raster.x == 0 && start_raster.y == nYSize - 1)
-        {
-            if (flow_direction(start_raster.x, start_raster.y - 1) == 0) {
-
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y - 1, input_raster(start_raster.x, start_raster.y - 1), insert_order, 70));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x, start_raster.y - 1) = 70;
-            }
+// Height above the nearest stream and flow distance to it, written to output_prefix + hand.tif
+// and distance_to_stream.tif. Distances are in metres for geographic DEMs, else in the units of
+// the geotransform (see CellSizes).
+template <typename Z, typename DirStore>
+bool write_hand_outputs(const std::string& output_prefix, const RunOptions& options, const Raster<Z>& input_raster,
+    TileBuffers<DirStore>& buffers, const GeoReference& geo, bool verbose) {
+    int nXSize = input_raster.max_x, nYSize = input_raster.max_y;
+    auto start = std::chrono::steady_clock::now();
+    CellSizes sizes;
+    sizes.set(geo.transform, nYSize, is_geographic(geo.projection));
+    Raster<float> hand(0, 0), distance(0, 0);
+    height_above_drainage(input_raster, buffers.flow_direction, buffers.mask.empty() ? NULL : &buffers.mask, options.hand_threshold,
+        sizes, options.threads, hand, distance);
+    if (verbose)
+        std::cout << "HAND in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+    return output_tiff(output_prefix + "hand.tif", hand, nXSize, nYSize, geo, options.output)
+        && output_tiff(output_prefix + "distance_to_stream.tif", distance, nXSize, nYSize, geo, options.output);
+}
 
-            if (flow_direction(start_raster.x + 1, start_raster.y) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y, input_raster(start_raster.x + 1, start_raster.y), insert_order, 40));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y) = 40;
-            }
-            if (flow_direction(start_raster.x + 1, start_raster.y - 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y - 1, input_raster(start_raster.x + 1, start_raster.y - 1), insert_order, 60));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y - 1) = 60;
-            }
+// Flow length of a flooded DEM, written to output_prefix + distance_to_outlet.tif and
+// longest_flow_path.tif (see flowlength.h), and the statistics of its catchments, written to
+// output_prefix + catchments.csv. The catchments are summed in the walk that sets the
+// distances to the outlets, so both share it and its raster.
+template <typename Z, typename DirStore>
+bool write_flow_length_outputs(const std::string& output_prefix, const RunOptions& options, const Raster<Z>& input_raster,
+    TileBuffers<DirStore>& buffers, const GeoReference& geo, bool verbose) {
+    int nXSize = buffers.flow_direction.max_x, nYSize = buffers.flow_direction.max_y;
+    CellSizes sizes;
+    sizes.set(geo.transform, nYSize, is_geographic(geo.projection));
+    Raster<double> to_outlet(0, 0), longest(0, 0);
+    if (options.catchments) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<Catchment> catchments;
+        catchment_statistics(input_raster, buffers.cells_to_process_accumulation, buffers.flow_direction,
+            buffers.mask.empty() ? NULL : &buffers.mask, sizes, options.threads, to_outlet, catchments);
+        if (verbose)
+            std::cout << catchments.size() << " catchments in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+        if (!write_catchments(output_prefix + "catchments.csv", catchments))
+            return false;
+    }
+    if (!options.flow_length)
+        return true;
+    if (!options.catchments)
+        distances_to_outlet(buffers.cells_to_process_accumulation, buffers.flow_direction, sizes, to_outlet, [](const CellPosition&, int, int) {});
+    longest_flow_paths(buffers.cells_to_process_accumulation, buffers.flow_direction, sizes, longest);
+    return output_tiff(output_prefix + "distance_to_outlet.tif", to_outlet, nXSize, nYSize, geo, options.output)
+        && output_tiff(output_prefix + "longest_flow_path.tif", longest, nXSize, nYSize, geo, options.output);
+}
+
+// Directions and upstream areas of the coarse grids of options.upscale_factors, written to
+// output_prefix + upscaled_<factor>_flow_direction.tif and upscaled_<factor>_upstream_area.tif
+template <typename DirStore>
+bool write_upscaled_outputs(const std::string& output_prefix, const RunOptions& options, TileBuffers<DirStore>& buffers,
+    const GeoReference& geo, bool verbose) {
+    auto start = std::chrono::steady_clock::now();
+    CellSizes sizes;
+    sizes.set(geo.transform, buffers.flow_direction.max_y, is_geographic(geo.projection));
+    Raster<double> area(0, 0);
+    upstream_areas(buffers.cells_to_process_accumulation, buffers.flow_direction, sizes, area);
+    Raster<unsigned int> coarse_direction(0, 0);
+    Raster<double> coarse_area(0, 0);
+    for (size_t i = 0; i < options.upscale_factors.size(); ++i) {
+        int factor = options.upscale_factors[i];
+        upscale_directions(buffers.flow_direction, area, sizes, factor, options.threads, coarse_direction, coarse_area);
+        GeoReference coarse_geo = geo;
+        for (int k = 1; k < 6; ++k)
+            if (k != 3)
+                coarse_geo.transform[k] *= factor;
+        std::string prefix = output_prefix + "upscaled_" + std::to_string(factor) + "_";
+        if (!output_tiff(prefix + "flow_direction.tif", coarse_direction, coarse_direction.max_x, coarse_direction.max_y, coarse_geo, options.output)
+            || !output_tiff(prefix + "upstream_area.tif", coarse_area, coarse_area.max_x, coarse_area.max_y, coarse_geo, options.output))
+            return false;
+    }
+    if (verbose)
+        std::cout << "upscaled in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+    return true;
+}
+
+// Stream networks of options.stream_thresholds written to output_prefix + stream_sweep.csv,
+// and with options.stream_masks their cells to streams_<threshold>.tif
+template <typename DirStore>
+bool write_stream_outputs(const std::string& output_prefix, const RunOptions& options, TileBuffers<DirStore>& buffers,
+    const GeoReference& geo, bool verbose) {
+    int nXSize = buffers.flow_direction.max_x, nYSize = buffers.flow_direction.max_y;
+    auto start = std::chrono::steady_clock::now();
+    CellSizes sizes;
+    sizes.set(geo.transform, nYSize, is_geographic(geo.projection));
+    StreamIndex index;
+    if (!build_stream_index(buffers.cells_to_process_accumulation, buffers.flow_direction, sizes, options.threads, index))
+        return false;
+    std::vector<StreamNetwork> networks;
+    sweep_streams(index, buffers.flow_direction, sizes, options.stream_thresholds, networks);
+    if (verbose)
+        std::cout << networks.size() << " stream networks in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+    if (!write_stream_sweep(output_prefix + "stream_sweep.csv", networks))
+        return false;
+    if (!options.stream_masks)
+        return true;
+    Raster<int16_t> streams(0, 0);
+    for (size_t t = 0; t < options.stream_thresholds.size(); ++t) {
+        stream_mask(index, options.stream_thresholds[t], streams);
+        if (!output_tiff(output_prefix + "streams_" + std::to_string(options.stream_thresholds[t]) + ".tif", streams, nXSize, nYSize, geo, options.output))
+            return false;
+    }
+    return true;
+}
+
+// Fill, flow direction and flow accumulation of one DEM, written to output_prefix +
+// flow_direction.tif and flow_accumulation.tif. Cell counts are kept in a CountStore.
+template <typename DirStore, typename CountStore = RasterVector<unsigned int> >
+bool process_dem(const std::string& dem_file, const std::string& output_prefix, const RunOptions& options,
+    TileBuffers<DirStore>& buffers, bool verbose) {
+    GeoReference geo;
+    buffers.set_layout(options.tile_shift);
+    return read_dem(dem_file, buffers, geo, verbose, [&](const auto& input_raster) {
+        flood_dem(options, input_raster, buffers);
+        if (!write_dem_outputs<DirStore, CountStore>(output_prefix, options, buffers, geo, verbose))
+            return false;
+        if (!options.upstream_index.empty()
+            && !write_upstream_index(options.upstream_index, buffers.flow_direction, buffers.cells_to_process_accumulation))
+            return false;
+        if ((options.flow_length || options.catchments)
+            && !write_flow_length_outputs(output_prefix, options, input_raster, buffers, geo, verbose))
+            return false;
+        if (!options.upscale_factors.empty() && !write_upscaled_outputs(output_prefix, options, buffers, geo, verbose))
+            return false;
+        if (!options.stream_thresholds.empty() && !write_stream_outputs(output_prefix, options, buffers, geo, verbose))
+            return false;
+        if (options.hand_threshold > 0 && !write_hand_outputs(output_prefix, options, input_raster, buffers, geo, verbose))
+            return false;
+        if ((options.depressions || !options.fsm_depths.empty())
+            && !write_depression_outputs(output_prefix, options, input_raster, buffers.mask.empty() ? NULL : &buffers.mask, geo, verbose))
+            return false;
+        // the checkpoint is only needed until the outputs are written
+        if (!options.checkpoint_file.empty())
+            std::remove(options.checkpoint_file.c_str());
+        return true;
+    });
+}
+
+// Does name match a pattern of * (any run of characters) and ? (any single character)
+bool wildcard_match(const char* pattern, const char* name) {
+    if (*pattern == 0)
+        return *name == 0;
+    if (*pattern == '*')
+        return wildcard_match(pattern + 1, name) || (*name != 0 && wildcard_match(pattern, name + 1));
+    if (*name != 0 && (*pattern == '?' || *pattern == *name))
+        return wildcard_match(pattern + 1, name + 1);
+    return false;
+}
 
+// DEM files of a batch: the files matching batch when it contains * or ?, otherwise the lines
+// of the manifest file batch (empty lines and lines starting with # are skipped). Sorted so
+// the order of a batch does not depend on the file system.
+bool batch_files(const std::string& batch, std::vector<std::string>& files) {
+    if (batch.find_first_of("*?") != std::string::npos) {
+        size_t slash = batch.find_last_of("/\\");
+        std::string dir = slash == std::string::npos ? "." : batch.substr(0, slash);
+        std::string pattern = slash == std::string::npos ? batch : batch.substr(slash + 1);
+        char** names = VSIReadDir(dir.c_str());
+        for (int i = 0; i < CSLCount(names); ++i) {
+            if (wildcard_match(pattern.c_str(), names[i]))
+                files.push_back(slash == std::string::npos ? std::string(names[i]) : dir + "/" + names[i]);
         }
-        // calculate neighbours direction for bottom right cell
-        else if (start_raster.x == nXSize - 1 && start_raster.y == nYSize - 1)
-        {
-            if (flow_direction(start_raster.x - 1, start_raster.y) == 0) {
-
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y, input_raster(start_raster.x - 1, start_raster.y), insert_order, 50));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y) = 50;
-            }
-            if (flow_direction(start_raster.x - 1, start_raster.y - 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y - 1, input_raster(start_raster.x - 1, start_raster.y - 1), insert_order, 80));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y - 1) = 80;
-            }
-            if (flow_direction(start_raster.x, start_raster.y - 1) == 0) {
-
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y - 1, input_raster(start_raster.x, start_raster.y - 1), insert_order, 70));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x, start_raster.y - 1) = 70;
-            }
+        CSLDestroy(names);
+    }
+    else {
+        std::ifstream manifest(batch);
+        if (!manifest) {
+            std::cerr << "Couldn't open manifest " << batch << std::endl;
+            return false;
         }
-        // calculate neighbours direction for left boundary
-        else if (start_raster.x == 0 && start_raster.y > 0 && start_raster.y < nYSize - 1)
-        {         
-            if (flow_direction(start_raster.x + 1, start_raster.y) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y, input_raster(start_raster.x + 1, start_raster.y), insert_order, 40));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y) = 40;
-            }
-            
-            if (flow_direction(start_raster.x, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y + 1, input_raster(start_raster.x, start_raster.y + 1), insert_order, 20));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x, start_raster.y + 1) = 20;
-            }
-            if (flow_direction(start_raster.x + 1, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y + 1, input_raster(start_raster.x + 1, start_raster.y + 1), insert_order, 10));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y + 1) = 10;
-            }
-            if (flow_direction(start_raster.x, start_raster.y - 1) == 0) {
-
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y - 1, input_raster(start_raster.x, start_raster.y - 1), insert_order, 70));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x, start_raster.y - 1) = 70;
-            }
-            if (flow_direction(start_raster.x + 1, start_raster.y - 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y - 1, input_raster(start_raster.x + 1, start_raster.y - 1), insert_order, 60));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y - 1) = 60;
-            }
-
+        std::string line;
+        while (std::getline(manifest, line)) {
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t'))
+                line.pop_back();
+            if (!line.empty() && line[0] != '#')
+                files.push_back(line);
         }
-        // calculate neighbours direction for right boundary cells
-        else if (start_raster.x == nXSize - 1 && start_raster.y > 0 && start_raster.y < nYSize - 1)
-        {
-            if (flow_direction(start_raster.x, start_raster.y - 1) == 0) {
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y - 1, input_raster(start_raster.x, start_raster.y - 1), insert_order, 70));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x, start_raster.y - 1) = 70;
-            }
-            if (flow_direction(start_raster.x, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y + 1, input_raster(start_raster.x, start_raster.y + 1), insert_order, 20));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x, start_raster.y + 1) = 20;
-            }
-            if (flow_direction(start_raster.x - 1, start_raster.y) == 0) {
-
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y, input_raster(start_raster.x - 1, start_raster.y), insert_order, 50));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y) = 50;
-            }
-            if (flow_direction(start_raster.x - 1, start_raster.y - 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y - 1, input_raster(start_raster.x - 1, start_raster.y - 1), insert_order, 80));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y - 1) = 80;
-            }
-            if (flow_direction(start_raster.x - 1, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y + 1, input_raster(start_raster.x - 1, start_raster.y + 1), insert_order, 30));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y + 1) = 30;
-            }
+    }
+    std::sort(files.begin(), files.end());
+    return true;
+}
 
+// Name of a DEM file without its directory and extension
+std::string file_stem(const std::string& path) {
+    size_t slash = path.find_last_of("/\\");
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return dot == std::string::npos || dot == 0 ? name : name.substr(0, dot);
+}
+
+// Process every DEM of a batch on a pool of workers. Each DEM is written to
+// output_dir/<name>_flow_direction.tif and <name>_flow_accumulation.tif, followed by a
+// <name>.done marker. DEMs that already have a marker are skipped, so a batch that was stopped
+// picks up where it left off when it is run again. Returns the number of DEMs that failed.
+template <typename DirStore = RasterVector<unsigned int>, typename CountStore = RasterVector<unsigned int> >
+int run_batch(const std::vector<std::string>& files, const std::string& output_dir, const RunOptions& options, int jobs) {
+    std::vector<TileBuffers<DirStore> > buffers(std::max(1, jobs));
+    std::atomic<int> next(0), finished(0), failed(0);
+    std::mutex output;
+    int total = (int)files.size();
+
+    auto worker = [&](int w) {
+        for (int i = next++; i < total; i = next++) {
+            std::string prefix = output_dir + "/" + file_stem(files[i]) + "_";
+            std::string marker = output_dir + "/" + file_stem(files[i]) + ".done";
+            bool skipped = (bool)std::ifstream(marker);
+            auto start = std::chrono::steady_clock::now();
+            bool ok = skipped || process_dem<DirStore, CountStore>(files[i], prefix, options, buffers[w], false);
+            if (ok && !skipped)
+                std::ofstream(marker) << files[i] << std::endl;
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> lock(output);
+            int done = ++finished;
+            if (!ok)
+                failed++;
+            std::cout << "[" << done << "/" << total << "] " << files[i]
+                << (skipped ? " already done" : ok ? " done in " : " failed");
+            if (ok && !skipped)
+                std::cout << seconds << " s";
+            std::cout << std::endl;
         }
-        // calculate neighbours direction top boundary cells
-        else if (start_raster.x > 0 && start_raster.x < nXSize - 1 && start_raster.y == 0)
-        {
-            if (flow_direction(start_raster.x + 1, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y + 1, input_raster(start_raster.x + 1, start_raster.y + 1), insert_order, 10));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y + 1) = 10;
-            }
-            if (flow_direction(start_raster.x - 1, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y + 1, input_raster(start_raster.x - 1, start_raster.y + 1), insert_order, 30));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y + 1) = 30;
-            }
-            if (flow_direction(start_raster.x, start_raster.y + 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y + 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y + 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y + 1, input_raster(start_raster.x, start_raster.y + 1), insert_order, 20));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x, start_raster.y + 1) = 20;
-            }
-            if (flow_direction(start_raster.x - 1, start_raster.y) == 0) {
-
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y, input_raster(start_raster.x - 1, start_raster.y), insert_order, 50));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y) = 50;
-            }
-            if (flow_direction(start_raster.x + 1, start_raster.y) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y, input_raster(start_raster.x + 1, start_raster.y), insert_order, 40));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y) = 40;
-            }
-        }
-        // calculate neighbours direction for bottom boundary cell
-        else if (start_raster.x > 0 && start_raster.x < nXSize - 1 && start_raster.y == nYSize - 1)
-        {
-            if (flow_direction(start_raster.x + 1, start_raster.y) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y, input_raster(start_raster.x + 1, start_raster.y), insert_order, 40));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y) = 40;
-            }
-            if (flow_direction(start_raster.x - 1, start_raster.y) == 0) {
-
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y, input_raster(start_raster.x - 1, start_raster.y), insert_order, 50));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y) = 50;
-            }
-            if (flow_direction(start_raster.x + 1, start_raster.y - 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x + 1, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x + 1, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x + 1, start_raster.y - 1, input_raster(start_raster.x + 1, start_raster.y - 1), insert_order, 60));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x + 1, start_raster.y - 1) = 60;
-            }
+    };
+
+    std::vector<std::thread> pool;
+    for (int w = 1; w < (int)buffers.size() && w < total; ++w)
+        pool.emplace_back(worker, w);
+    worker(0);
+    for (size_t w = 0; w < pool.size(); ++w)
+        pool[w].join();
+    return failed;
+}
 
-            if (flow_direction(start_raster.x, start_raster.y - 1) == 0) {
+// Place the tiles of a mosaic from their geotransforms, in cells from the top left tile
+void place_tiles(const std::vector<GeoReference>& geo, std::vector<MosaicTile>& tiles) {
+    double left = geo[0].transform[0], top = geo[0].transform[3];
+    for (size_t t = 1; t < geo.size(); ++t) {
+        left = std::min(left, geo[t].transform[0]);
+        top = geo[0].transform[5] < 0 ? std::max(top, geo[t].transform[3]) : std::min(top, geo[t].transform[3]);
+    }
+    for (size_t t = 0; t < geo.size(); ++t) {
+        tiles[t].x0 = (int)std::lround((geo[t].transform[0] - left) / geo[0].transform[1]);
+        tiles[t].y0 = (int)std::lround((geo[t].transform[3] - top) / geo[0].transform[5]);
+    }
+}
 
-                if (flow_direction.If_add_to_queue(start_raster.x, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x, start_raster.y - 1, input_raster(start_raster.x, start_raster.y - 1), insert_order, 70));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x, start_raster.y - 1) = 70;
-            }
+// Accumulation of a mosaic tile with the water from the other tiles added, written as T.
+// Trees reached inside the tile are turned around to drain through their spill, roots reached
+// across a seam get the direction into the next tile, the other roots stay 0.
+template <typename T>
+bool write_mosaic_tile(const std::string& prefix, const MosaicTile& tile, const MosaicInflow& inflow,
+    TileBuffers<>& buffers, const GeoReference& geo, const OutputFormat& format) {
+    int nXSize = tile.width, nYSize = tile.height;
+    Raster<>& flow_direction = buffers.flow_direction;
+    flow_direction.reset(nXSize, nYSize);
+    if (!read_raster((prefix + "flow_direction.tif").c_str(), nXSize, nYSize, flow_direction))
+        return false;
+    for (size_t r = 0; r < tile.roots.size(); ++r) {
+        if (inflow.spill[r] < 0)
+            continue;
+        const TileSpill& edge = tile.spills[inflow.spill[r]];
+        if (edge.u == r)
+            reroot_tree(flow_direction, edge.cell_u, edge.cell_v);
+        else
+            reroot_tree(flow_direction, edge.cell_v, edge.cell_u);
+    }
+    std::deque<CellPosition>& order = buffers.cells_to_process_accumulation;
+    order.clear();
+    flow_order(flow_direction, order);
+
+    Raster<double> entering(nXSize, nYSize);
+    entering.fill();
+    for (size_t r = 0; r < tile.roots.size(); ++r)
+        entering(tile.roots[r].x, tile.roots[r].y) = inflow.inflow[r];
+    Raster<double> total(nXSize, nYSize);
+    total.fill();
+    accumulate_flow(order, flow_direction, total, InflowWeight(&entering), false);
+
+    Raster<T> flow_accumulation(nXSize, nYSize);
+    flow_accumulation.fill();
+    for (int y = 0; y < nYSize; ++y)
+        for (int x = 0; x < nXSize; ++x)
+            flow_accumulation(x, y) = (T)(total(x, y) + entering(x, y));
+    for (size_t r = 0; r < tile.roots.size(); ++r) {
+        const MosaicRoot& root = tile.roots[r];
+        if (inflow.spill[r] >= 0)
+            continue;
+        if (inflow.link_dir[r] == 0)
+            flow_accumulation(root.x, root.y) = 0;
+        flow_direction(root.x, root.y) = inflow.link_dir[r];
+    }
+    return output_tiff(prefix + "flow_direction.tif", flow_direction, nXSize, nYSize, geo, format)
+        && output_tiff(prefix + "flow_accumulation.tif", flow_accumulation, nXSize, nYSize, geo, format);
+}
 
-            if (flow_direction(start_raster.x - 1, start_raster.y - 1) == 0)
-            {
-                if (flow_direction.If_add_to_queue(start_raster.x - 1, start_raster.y - 1) == 0)
-                {
-                    flow_direction.Add_to_queue(start_raster.x - 1, start_raster.y - 1);
-                    cells_to_process_flow.push(RasterCell(start_raster.x - 1, start_raster.y - 1, input_raster(start_raster.x - 1, start_raster.y - 1), insert_order, 80));
-                    insert_order++;
-                }
-                flow_direction(start_raster.x - 1, start_raster.y - 1) = 80;
+// Process the DEMs of a batch as one seamless mosaic, see mosaic.h. First every tile is
+// flooded on the workers and keeps only its edge table, then the links between tiles are
+// solved, then every tile reads its directions back and adds the water from upstream tiles.
+// Outputs are named as in run_batch. Returns the number of DEMs that failed.
+int run_mosaic(const std::vector<std::string>& files, const std::string& output_dir, const RunOptions& options, int jobs) {
+    int total = (int)files.size();
+    std::vector<TileBuffers<> > buffers(std::max(1, jobs));
+    std::vector<MosaicTile> tiles(total);
+    std::vector<GeoReference> geo(total);
+    std::vector<char> ok(total, 0);
+    std::mutex output;
+    auto prefix = [&](int i) { return output_dir + "/" + file_stem(files[i]) + "_"; };
+
+    // run job(i, buffers of the worker) for every tile on the workers
+    auto run = [&](const std::function<bool(int, TileBuffers<>&)>& job, const char* step) {
+        std::atomic<int> next(0), finished(0);
+        auto worker = [&](int w) {
+            for (int i = next++; i < total; i = next++) {
+                bool done = ok[i] && job(i, buffers[w]);
+                ok[i] = done;
+                std::lock_guard<std::mutex> lock(output);
+                std::cout << "[" << ++finished << "/" << total << "] " << step << " " << files[i] << (done ? "" : " failed") << std::endl;
             }
+        };
+        std::vector<std::thread> pool;
+        for (int w = 1; w < (int)buffers.size() && w < total; ++w)
+            pool.emplace_back(worker, w);
+        worker(0);
+        for (size_t w = 0; w < pool.size(); ++w)
+            pool[w].join();
+    };
+
+    std::fill(ok.begin(), ok.end(), 1);
+    run([&](int i, TileBuffers<>& b) {
+        b.set_layout(options.tile_shift);
+        return read_dem(files[i], b, geo[i], false, [&](const auto& input_raster) {
+            flood_dem(options, input_raster, b);
+            Raster<double> flow_accumulation(input_raster.max_x, input_raster.max_y);
+            flow_accumulation.set_layout(options.tile_shift);
+            flow_accumulation.fill();
+            accumulate_flow(b.cells_to_process_accumulation, b.flow_direction, flow_accumulation, UnitWeight(), false);
+            extract_edge(input_raster, b.flow_direction, b.cells_to_process_accumulation, flow_accumulation, tiles[i],
+                b.mask.empty() ? NULL : &b.mask);
+            // plain GeoTIFF, it is read back and written in the output format by the last pass
+            return output_tiff(prefix(i) + "flow_direction.tif", b.flow_direction, b.flow_direction.max_x, b.flow_direction.max_y, geo[i]);
+        });
+    }, "flooded");
+    for (int i = 0; i < total; ++i) {
+        if (!ok[i]) {
+            std::cerr << "Mosaic needs every tile" << std::endl;
+            return total;
+        }
+    }
+
+    place_tiles(geo, tiles);
+    size_t unlinked;
+    std::vector<MosaicInflow> inflow = solve_mosaic(tiles, unlinked);
+    if (unlinked > 0)
+        std::cout << unlinked << " outlets between tiles left unlinked, no outlet of the mosaic below them" << std::endl;
+
+    run([&](int i, TileBuffers<>& b) {
+        if (options.accumulation_type == "double")
+            return write_mosaic_tile<double>(prefix(i), tiles[i], inflow[i], b, geo[i], options.output);
+        if (options.accumulation_type == "float")
+            return write_mosaic_tile<float>(prefix(i), tiles[i], inflow[i], b, geo[i], options.output);
+        return write_mosaic_tile<unsigned int>(prefix(i), tiles[i], inflow[i], b, geo[i], options.output);
+    }, "accumulated");
+    int failed = 0;
+    for (int i = 0; i < total; ++i)
+        if (!ok[i])
+            failed++;
+    return failed;
+}
 
+// Answer queries on an upstream index read from standard input, one per line:
+//   x y              cells upstream of (x, y), itself included
+//   x y x2 y2        1 when (x, y) drains through (x2, y2), 0 otherwise
+//   cells x y        the upstream cells of (x, y) as x,y pairs
+// and report the time spent answering them, which is what a service would add per request.
+int run_queries(const std::string& index_file) {
+    UpstreamIndex index;
+    if (!index.open(index_file))
+        return 1;
+    std::string line;
+    size_t queries = 0;
+    double total = 0, slowest = 0;
+    std::string answer;
+    while (std::getline(std::cin, line)) {
+        std::istringstream words(line);
+        std::string first;
+        if (!(words >> first))
+            continue;
+        int v[4];
+        int n = 0;
+        bool list = first == "cells";
+        if (!list) {
+            v[n++] = atoi(first.c_str());
         }
+        while (n < 4 && words >> v[n])
+            n++;
+        if ((list && n != 2) || (!list && n != 2 && n != 4)) {
+            std::cerr << "Bad query " << line << std::endl;
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        answer.clear();
+        if (list) {
+            index.for_each_upstream(v[0], v[1], [&](int x, int y) {
+                answer += std::to_string(x) + "," + std::to_string(y) + " ";
+            });
+        }
+        else if (n == 2) {
+            answer = std::to_string(index.upstream_cells(v[0], v[1]));
+        }
+        else {
+            answer = index.is_upstream(v[0], v[1], v[2], v[3]) ? "1" : "0";
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        total += seconds;
+        slowest = std::max(slowest, seconds);
+        queries++;
+        std::cout << answer << "\n";
+    }
+    std::cout.flush();
+    if (queries > 0)
+        std::cerr << queries << " queries, " << total / queries * 1e6 << " us on average, " << slowest * 1e6 << " us at most" << std::endl;
+    return 0;
+}
+
 
-        // change the visit status of each cell
-        flow_direction.Is_Visited(start_raster.x, start_raster.y);
-        // add to the cell to the stack to calculate flow accumulation later
-        cells_to_process_accumulation.push_back(start_raster);
-        //delete and select new center cell
-        cells_to_process_flow.pop();
+int main(int argc, const char* argv[]) {
+    RunOptions options;
+    std::string input_file = "N36E076.hgt";
+    std::string batch;
+    std::string output_dir = ".";
+    int jobs = 1;
+    bool mosaic = false;
+    std::string format = "gtiff";
+    std::string layout = "rows";
+    std::string huge_pages = "none";
+    std::string numa = "local";
+    std::string query_index;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--rainfall" && i + 1 < argc)
+            options.rainfall_file = argv[++i];
+        else if (arg == "--runoff" && i + 1 < argc)
+            options.runoff_file = argv[++i];
+        else if (arg == "--loss" && i + 1 < argc)
+            options.loss_file = argv[++i];
+        else if (arg == "--accumulation-type" && i + 1 < argc)
+            options.accumulation_type = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc)
+            options.threads = std::max(1, atoi(argv[++i]));
+        else if (arg == "--tile-size" && i + 1 < argc)
+            options.tile_size = std::max(2, atoi(argv[++i]));
+        else if (arg == "--queue" && i + 1 < argc)
+            options.queue_type = argv[++i];
+        else if (arg == "--input" && i + 1 < argc)
+            input_file = argv[++i];
+        else if (arg == "--batch" && i + 1 < argc)
+            batch = argv[++i];
+        else if (arg == "--output-dir" && i + 1 < argc)
+            output_dir = argv[++i];
+        else if (arg == "--jobs" && i + 1 < argc)
+            jobs = std::max(1, atoi(argv[++i]));
+        else if (arg == "--mosaic")
+            mosaic = true;
+        else if (arg == "--storage" && i + 1 < argc)
+            options.storage = argv[++i];
+        else if (arg == "--format" && i + 1 < argc)
+            format = argv[++i];
+        else if (arg == "--compress-threads" && i + 1 < argc)
+            options.output.threads = std::max(1, atoi(argv[++i]));
+        else if (arg == "--layout" && i + 1 < argc)
+            layout = argv[++i];
+        else if (arg == "--huge-pages" && i + 1 < argc)
+            huge_pages = argv[++i];
+        else if (arg == "--numa" && i + 1 < argc)
+            numa = argv[++i];
+        else if (arg == "--upstream-index" && i + 1 < argc)
+            options.upstream_index = argv[++i];
+        else if (arg == "--query-index" && i + 1 < argc)
+            query_index = argv[++i];
+        else if (arg == "--hand" && i + 1 < argc)
+            options.hand_threshold = (uint32_t)std::max(1, atoi(argv[++i]));
+        else if (arg == "--flow-length")
+            options.flow_length = true;
+        else if (arg == "--catchments")
+            options.catchments = true;
+        else if (arg == "--upscale" && i + 1 < argc) {
+            std::stringstream factors(argv[++i]);
+            std::string factor;
+            while (std::getline(factors, factor, ','))
+                options.upscale_factors.push_back(std::max(1, atoi(factor.c_str())));
+        }
+        else if (arg == "--stream-thresholds" && i + 1 < argc) {
+            std::stringstream thresholds(argv[++i]);
+            std::string threshold;
+            while (std::getline(thresholds, threshold, ','))
+                options.stream_thresholds.push_back((uint32_t)std::max(1, atoi(threshold.c_str())));
+        }
+        else if (arg == "--stream-masks")
+            options.stream_masks = true;
+        else if (arg == "--depressions")
+            options.depressions = true;
+        else if (arg == "--fsm-depths" && i + 1 < argc) {
+            std::stringstream depths(argv[++i]);
+            std::string depth;
+            while (std::getline(depths, depth, ','))
+                options.fsm_depths.push_back(atof(depth.c_str()));
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc)
+            options.checkpoint_file = argv[++i];
+        else if (arg == "--checkpoint-interval" && i + 1 < argc)
+            options.checkpoint_interval = std::max(0.0, atof(argv[++i]));
+        else if (arg == "--resume")
+            options.resume = true;
+        else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--input dem | --batch manifest|pattern [--output-dir dir] [--jobs n] [--mosaic]] [--rainfall file [--runoff file] [--loss file]] [--accumulation-type count|float|double] [--threads n [--tile-size n]] [--queue bucket|heap] [--storage plain|compact] [--layout rows|tiles] [--huge-pages none|transparent|hugetlb] [--numa local|interleave] [--format gtiff|cog [--compress-threads n]] [--checkpoint file [--checkpoint-interval seconds] [--resume]] [--upstream-index file] [--depressions] [--fsm-depths d1,d2,...] [--hand cells] [--flow-length] [--catchments] [--upscale f1,f2,...] [--stream-thresholds t1,t2,... [--stream-masks]] | --query-index file" << std::endl;
+            return 1;
+        }
+    }
+    // queries only map the index, no DEM is processed
+    if (!query_index.empty())
+        return run_queries(query_index);
+    if ((options.runoff_file != NULL || options.loss_file != NULL) && options.rainfall_file == NULL) {
+        std::cerr << "--runoff and --loss need --rainfall" << std::endl;
+        return 1;
+    }
+    if (options.rainfall_file != NULL && !batch.empty()) {
+        std::cerr << "--rainfall is for a single DEM and can't be used with --batch" << std::endl;
+        return 1;
+    }
+    if (mosaic && batch.empty()) {
+        std::cerr << "--mosaic needs the tiles given with --batch" << std::endl;
+        return 1;
+    }
+    if (options.rainfall_file != NULL && options.accumulation_type == "count")
+        options.accumulation_type = "float";
+    if (options.accumulation_type != "count" && options.accumulation_type != "float" && options.accumulation_type != "double") {
+        std::cerr << "Unknown accumulation type " << options.accumulation_type << std::endl;
+        return 1;
+    }
+    if (options.queue_type != "bucket" && options.queue_type != "heap") {
+        std::cerr << "Unknown queue " << options.queue_type << std::endl;
+        return 1;
+    }
+    if (options.storage != "plain" && options.storage != "compact") {
+        std::cerr << "Unknown storage " << options.storage << std::endl;
+        return 1;
+    }
+    if (format != "gtiff" && format != "cog") {
+        std::cerr << "Unknown format " << format << std::endl;
+        return 1;
+    }
+    options.output.cog = format == "cog";
+    if (layout != "rows" && layout != "tiles") {
+        std::cerr << "Unknown layout " << layout << std::endl;
+        return 1;
+    }
+    options.tile_shift = layout == "tiles" ? TILE_LAYOUT_SHIFT : 0;
+    if (huge_pages != "none" && huge_pages != "transparent" && huge_pages != "hugetlb") {
+        std::cerr << "Unknown huge pages " << huge_pages << std::endl;
+        return 1;
     }
-    // output tif file
-    output_tiff("flow_direction.tif", flow_direction, nXSize, nYSize);
-    std::cout << "finish output flow direction tiff file" << std::endl;
+    if (numa != "local" && numa != "interleave") {
+        std::cerr << "Unknown NUMA placement " << numa << std::endl;
+        return 1;
+    }
+    // before the first raster is allocated
+    memory_policy().huge_pages = huge_pages == "hugetlb" ? HugePages::hugetlb : huge_pages == "transparent" ? HugePages::transparent : HugePages::none;
+    memory_policy().interleave = numa == "interleave";
+    memory_policy().threads = std::max(1, options.threads);
+    if (!options.checkpoint_file.empty() && (options.threads > 0 || !batch.empty())) {
+        std::cerr << "--checkpoint is for the serial flood of a single DEM and can't be used with --threads or --batch" << std::endl;
+        return 1;
+    }
+    if (!options.upstream_index.empty() && !batch.empty()) {
+        std::cerr << "--upstream-index is for a single DEM and can't be used with --batch" << std::endl;
+        return 1;
+    }
+    if ((options.depressions || !options.fsm_depths.empty() || options.hand_threshold > 0 || options.flow_length || options.catchments
+        || !options.upscale_factors.empty() || !options.stream_thresholds.empty()) && mosaic) {
+        std::cerr << "--depressions, --fsm-depths, --hand, --flow-length, --catchments, --upscale and --stream-thresholds can't be used with --mosaic" << std::endl;
+        return 1;
+    }
+    if (options.resume && options.checkpoint_file.empty()) {
+        std::cerr << "--resume needs the --checkpoint file" << std::endl;
+        return 1;
+    }
+    if (options.storage == "compact" && mosaic) {
+        std::cerr << "--storage compact can't be used with --mosaic" << std::endl;
+        return 1;
+    }
+    // compact storage: 4 bit directions for the serial flood, bytes when tiles are flooded in parallel
+    bool packed = options.storage == "compact" && options.threads == 0;
+    bool byte_directions = options.storage == "compact" && options.threads > 0;
 
-    // initialize the flow accumulation raster
-    Raster flow_accumulation(nXSize, nYSize);
-    flow_accumulation.fill();
-    RasterCell cell = cells_to_process_accumulation.back();
-    //iterate and calculate flow accumulation base on the flow direction
-    while (cells_to_process_accumulation.empty() != true)
-    {
-        cell = cells_to_process_accumulation.back();
-        int x = cell.x;
-        int y = cell.y;
-        int dir = flow_direction(x,y);
-        switch (dir)
-        {
-        case 10:
-            if (x - 1 >= 0 && x - 1 < nXSize && y - 1 >= 0 && y - 1 < nYSize) 
-            {
-                flow_accumulation(x - 1, y - 1) += flow_accumulation(x, y) + 1;
-                break;
-            }
-        case 20:
-            if (x >= 0 && x < nXSize && y - 1 >= 0 && y - 1 < nYSize) 
-            {
-                flow_accumulation(x, y - 1) += flow_accumulation(x, y) + 1;
-                break;
-            }
-        case 30:
-            if (x + 1 >= 0 && x + 1 < nXSize && y - 1 >= 0 && y - 1 < nYSize) 
-            {
-                flow_accumulation(x + 1, y - 1) += flow_accumulation(x, y) + 1;
-                break;
-            }
-        case 40:
-            if (x - 1 >= 0 && x - 1 < nXSize && y >= 0 && y < nYSize) 
-            {
-                flow_accumulation(x - 1, y) += flow_accumulation(x, y) + 1;
-                break;
-            }
-        case 50:
-            if (x + 1 >= 0 && x + 1 < nXSize && y >= 0 && y < nYSize) 
-            {
-                flow_accumulation(x + 1, y) += flow_accumulation(x, y) + 1;
-                break;
-            }
-        case 60:
-            if (x - 1 >= 0 && x - 1 < nXSize && y + 1 >= 0 && y + 1 < nYSize) {
-                flow_accumulation(x - 1, y + 1) += flow_accumulation(x, y) + 1;
-                break;
-            }
-        case 70:
-            if (x >= 0 && x < nXSize && y + 1 >= 0 && y + 1 < nYSize) {
-                flow_accumulation(x, y + 1) += flow_accumulation(x, y) + 1;
-                break;
-            }
-        case 80:
-            if (x + 1 >= 0 && x + 1 < nXSize && y + 1 >= 0 && y + 1 < nYSize) {
-                flow_accumulation(x + 1, y + 1) += flow_accumulation(x, y) + 1;
-                break;
-            }
-        case 0:
-            if (x >= 0 && x < nXSize && y >= 0 && y < nYSize) {
-                flow_accumulation(x, y) = 0;
-                break;
-            }
+    // drivers are registered once for all DEMs and workers
+    GDALAllRegister();
+    int result = 0;
+    if (batch.empty()) {
+        bool ok;
+        if (packed) {
+            TileBuffers<PackedDirections> buffers;
+            ok = process_dem<PackedDirections, CompactCounts<unsigned int> >(input_file, "", options, buffers, true);
+        }
+        else if (byte_directions) {
+            TileBuffers<ByteDirections> buffers;
+            ok = process_dem<ByteDirections, CompactCounts<unsigned int> >(input_file, "", options, buffers, true);
         }
-        cells_to_process_accumulation.pop_back();
+        else {
+            TileBuffers<> buffers;
+            ok = process_dem(input_file, "", options, buffers, true);
+        }
+        result = ok ? 0 : 1;
     }
-    //output flow accumulation raster
-    output_tiff("flow_accumulation.tif", flow_accumulation, nXSize, nYSize);
-    std::cout << "finish output flow_accumulation tiff file" << std::endl;
-    GDALClose(input_dataset);
-    return 0;
+    else {
+        std::vector<std::string> files;
+        if (!batch_files(batch, files)) {
+            result = 1;
+        }
+        else {
+            int failed;
+            if (mosaic)
+                failed = run_mosaic(files, output_dir, options, jobs);
+            else if (packed)
+                failed = run_batch<PackedDirections, CompactCounts<unsigned int> >(files, output_dir, options, jobs);
+            else if (byte_directions)
+                failed = run_batch<ByteDirections, CompactCounts<unsigned int> >(files, output_dir, options, jobs);
+            else
+                failed = run_batch(files, output_dir, options, jobs);
+            std::cout << files.size() - failed << " of " << files.size() << " DEMs processed" << std::endl;
+            result = failed > 0 ? 1 : 0;
+        }
+    }
+    GDALDestroyDriverManager();
+    return result;
 }
@@ -0,0 +1,154 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "parallel.h"
+
+
+// Memory of the large raster buffers
+//
+// Rasters keep their cells in vectors with RasterAllocator. Buffers of LARGE_BUFFER bytes and
+// more are mapped on their own (as malloc does for large blocks) in 2 MB steps, so how their
+// pages are backed can be chosen at run time with the MemoryPolicy:
+// - huge pages: transparent huge pages are asked for with madvise, so a 2 MB page takes one
+//   TLB entry where 512 small pages took 512. hugetlb maps explicit huge pages from the pool
+//   reserved by the system (vm.nr_hugepages) and falls back to transparent ones when it is empty.
+// - interleave: pages are spread round robin over the NUMA nodes the process may use, so the
+//   threads of the parallel flood on all sockets share the memory bandwidth of every node.
+//   Otherwise a page lands on the node of the thread that first writes it, so large buffers
+//   are zeroed by the flood's workers, a share each, instead of all on the main thread.
+// Elsewhere than on Linux the buffers come from operator new and the policy has no effect.
+
+enum class HugePages { none, transparent, hugetlb };
+
+struct MemoryPolicy {
+    HugePages huge_pages = HugePages::none;
+    bool interleave = false; // spread pages over the NUMA nodes
+    int threads = 1; // workers zeroing the large buffers
+};
+
+// The policy of all rasters, set from the options before any raster is filled
+inline MemoryPolicy& memory_policy() {
+    static MemoryPolicy policy;
+    return policy;
+}
+
+const size_t LARGE_BUFFER = (size_t)2 << 20;
+
+#ifdef __linux__
+// NUMA nodes the process may allocate on, read once; false when the kernel has no NUMA support
+inline bool allowed_nodes(const unsigned long*& mask, unsigned long& max_node) {
+    const int MPOL_F_MEMS_ALLOWED_FLAG = 4;
+    static unsigned long nodes[1024 / (8 * sizeof(unsigned long))];
+    static bool known = syscall(SYS_get_mempolicy, NULL, nodes, (unsigned long)1024, NULL, MPOL_F_MEMS_ALLOWED_FLAG) == 0;
+    mask = nodes;
+    max_node = 1024;
+    return known;
+}
+
+// Map bytes (a multiple of 2 MB) with the huge pages and placement of the policy
+inline void* map_large(size_t bytes, const MemoryPolicy& policy) {
+    void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (policy.huge_pages == HugePages::hugetlb)
+        p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        if (policy.huge_pages != HugePages::none)
+            madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    const unsigned long* nodes;
+    unsigned long max_node;
+    if (policy.interleave && allowed_nodes(nodes, max_node)) {
+        const int MPOL_INTERLEAVE_MODE = 3;
+        syscall(SYS_mbind, p, bytes, MPOL_INTERLEAVE_MODE, nodes, max_node, 0);
+    }
+    return p;
+}
+#endif
+
+// Allocator of raster buffers following memory_policy()
+template <typename T>
+struct RasterAllocator {
+    typedef T value_type;
+
+    RasterAllocator() {}
+
+    template <typename U>
+    RasterAllocator(const RasterAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        size_t bytes = n * sizeof(T);
+#ifdef __linux__
+        if (bytes >= LARGE_BUFFER) {
+            void* p = map_large(mapped_size(bytes), memory_policy());
+            if (p == NULL)
+                throw std::bad_alloc();
+            return (T*)p;
+        }
+#endif
+        return (T*)::operator new(bytes);
+    }
+
+    void deallocate(T* p, size_t n) {
+        size_t bytes = n * sizeof(T);
+#ifdef __linux__
+        if (bytes >= LARGE_BUFFER) {
+            munmap(p, mapped_size(bytes));
+            return;
+        }
+#endif
+        ::operator delete(p);
+    }
+
+    // Size of the mapping of a large buffer, whole huge pages
+    static size_t mapped_size(size_t bytes) {
+        return (bytes + LARGE_BUFFER - 1) / LARGE_BUFFER * LARGE_BUFFER;
+    }
+
+    // Values are left unset when no value is given, zero_fill writes them on the workers
+    template <typename U>
+    void construct(U* p) { ::new ((void*)p) U; }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) { ::new ((void*)p) U(std::forward<Args>(args)...); }
+
+    bool operator==(const RasterAllocator&) const { return true; }
+    bool operator!=(const RasterAllocator&) const { return false; }
+};
+
+// Vector of raster cells, see RasterAllocator
+template <typename T>
+using RasterVector = std::vector<T, RasterAllocator<T> >;
+
+// Make buffer n zeros. A large buffer is zeroed by memory_policy().threads workers, each its
+// own share, so its pages are first touched on the nodes of the threads that flood it.
+template <typename T>
+void zero_fill(RasterVector<T>& buffer, size_t n) {
+    int shares = memory_policy().threads;
+    if (shares <= 1 || n * sizeof(T) < LARGE_BUFFER) {
+        buffer.assign(n, 0);
+        return;
+    }
+    buffer.clear();
+    buffer.resize(n);
+    T* values = buffer.data();
+    parallel_for(shares, shares, [&](int s) {
+        size_t begin = n * s / shares, end = n * (s + 1) / shares;
+        memset(values + begin, 0, (end - begin) * sizeof(T));
+    });
+}
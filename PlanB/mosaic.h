@@ -0,0 +1,303 @@
+#pragma once
+#include <queue>
+#include <deque>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include "raster.h"
+#include "flood.h"
+
+
+// Mosaic of tiles processed one at a time
+//
+// Every tile is flooded on its own, so all of its border cells are roots: outlets its other
+// cells drain to. As in the parallel flood (flood.h) each tile keeps a table of its roots,
+// their elevation and the water leaving the tile there, and of the lowest spill between the
+// trees of every two roots that touch inside it. Tiles meeting edge to edge add a spill
+// between every two border cells that touch across a seam, at the higher of their elevations.
+// A priority flood over the roots of all tiles, from the roots at the mosaic border or next to
+// nodata that stay outlets as they would in one DEM, reaches every other root at the lowest
+// level its water can leave at, through flats and over depressions at the seams alike. A root
+// reached inside its tile has its tree turned around to drain through that spill, one reached
+// across a seam drains into the border cell on the other side, where the water enters that
+// tile. The flood reaches every root from one reached before it, so the water is added up in
+// the reverse order; each tile then adds the water entering it to its own accumulation. Only
+// the tables of all tiles are in memory at once. Tiles are meant to meet edge to edge, cells
+// two tiles share are counted in both.
+
+// Where the trees of two roots of a tile meet: cell_u belongs to the tree of u, cell_v to v
+struct TileSpill {
+    uint32_t u, v; // index of the roots in the tile
+    double level_u, level_v; // level water rises to at the two cells in their trees
+    uint64_t cell_u, cell_v; // cell_id of the two cells in the tile
+};
+
+// Cell of a tile that drains nowhere inside it, in tile coordinates
+struct MosaicRoot {
+    int x, y;
+    double elevation;
+    bool outlet; // next to nodata, an outlet of the mosaic too
+    double outflow; // water leaving the tile here, the root itself included
+};
+
+// Placement of a tile in the mosaic and its table of roots
+struct MosaicTile {
+    int x0, y0; // position of the top left cell in the mosaic
+    int width, height;
+    std::vector<MosaicRoot> roots;
+    std::vector<TileSpill> spills; // lowest spill per pair of touching trees
+};
+
+// Water a tile receives from the others, and how its roots drain
+struct MosaicInflow {
+    std::vector<double> inflow; // per root, water entering the tile there from another tile
+    std::vector<int> link_dir; // per root, direction into the next tile the root drains to, 0 otherwise
+    std::vector<int> spill; // per root, spill of the tile its tree drains through, -1 otherwise
+};
+
+// Build the table of a flooded tile. order is the accumulation order of the tile (every cell
+// after the cell it drains to) and flow_accumulation its accumulation with the outlets kept.
+// Nodata cells are left out of the table, so no water is passed through them.
+template <typename Z, typename T, typename DirStore, typename AccStore>
+void extract_edge(const Raster<Z>& input_raster, const Raster<unsigned int, DirStore>& flow_direction, const std::deque<CellPosition>& order,
+    const Raster<T, AccStore>& flow_accumulation, MosaicTile& tile, const NodataMask* mask = NULL) {
+    int width = flow_direction.max_x, height = flow_direction.max_y;
+    tile.width = width;
+    tile.height = height;
+    tile.roots.clear();
+    tile.spills.clear();
+
+    // root every cell drains to and the level water rises to there, from the outlets upstream
+    std::vector<uint32_t> label(flow_direction.cell_count(), NO_NODE);
+    std::vector<double> level(flow_direction.cell_count(), 0);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            if (flow_direction(x, y) != 0 || is_masked(mask, x, y))
+                continue;
+            MosaicRoot root;
+            root.x = x;
+            root.y = y;
+            root.elevation = input_raster(x, y);
+            // inside the tile only cells next to nodata are roots
+            root.outlet = x > 0 && y > 0 && x < width - 1 && y < height - 1;
+            for (int dy = -1; dy <= 1 && !root.outlet && mask != NULL; ++dy)
+                for (int dx = -1; dx <= 1 && !root.outlet; ++dx)
+                    if (x + dx >= 0 && y + dy >= 0 && x + dx < width && y + dy < height)
+                        root.outlet = is_masked(mask, x + dx, y + dy);
+            root.outflow = (double)flow_accumulation(x, y) + 1;
+            label[flow_direction.index(x, y)] = (uint32_t)tile.roots.size();
+            level[flow_direction.index(x, y)] = root.elevation;
+            tile.roots.push_back(root);
+        }
+    }
+    for (size_t i = 0; i < order.size(); ++i) {
+        int x = order[i].x, y = order[i].y;
+        int down_x = x, down_y = y;
+        if (!flow_target(flow_direction(x, y), down_x, down_y))
+            continue;
+        label[flow_direction.index(x, y)] = label[flow_direction.index(down_x, down_y)];
+        level[flow_direction.index(x, y)] = std::max((double)input_raster(x, y), level[flow_direction.index(down_x, down_y)]);
+    }
+
+    // spills between the trees, each pair of touching cells taken once, keeping the lowest
+    // one per pair of roots
+    static const Offset forward[4] = { { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+    std::unordered_map<uint64_t, size_t> pair_edge;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint32_t a = label[flow_direction.index(x, y)];
+            if (a == NO_NODE)
+                continue;
+            for (int f = 0; f < 4; ++f) {
+                int nx = x + forward[f].dx, ny = y + forward[f].dy;
+                if (nx < 0 || ny >= height || nx >= width)
+                    continue;
+                uint32_t b = label[flow_direction.index(nx, ny)];
+                if (b == NO_NODE || b == a)
+                    continue;
+                uint64_t pair = a < b ? ((uint64_t)a << 32 | b) : ((uint64_t)b << 32 | a);
+                TileSpill edge = { a, b, level[flow_direction.index(x, y)], level[flow_direction.index(nx, ny)],
+                    flow_direction.cell_id(x, y), flow_direction.cell_id(nx, ny) };
+                auto found = pair_edge.find(pair);
+                if (found == pair_edge.end()) {
+                    pair_edge[pair] = tile.spills.size();
+                    tile.spills.push_back(edge);
+                }
+                else if (std::max(edge.level_u, edge.level_v) < std::max(tile.spills[found->second].level_u, tile.spills[found->second].level_v)) {
+                    tile.spills[found->second] = edge;
+                }
+            }
+        }
+    }
+}
+
+// Spill of the mosaic graph: inside a tile (spill is its index in the table of the tile) or
+// across a seam (spill -1)
+struct MosaicSpill {
+    uint32_t u, v;
+    double level_u, level_v;
+    int spill;
+};
+
+// Flood the roots of all tiles, add up the water through the spills they are reached by and
+// return what every tile receives. unlinked counts the roots no outlet of the mosaic reaches.
+inline std::vector<MosaicInflow> solve_mosaic(const std::vector<MosaicTile>& tiles, size_t& unlinked) {
+    std::vector<uint32_t> first_node(tiles.size() + 1, 0);
+    for (size_t t = 0; t < tiles.size(); ++t)
+        first_node[t + 1] = first_node[t] + (uint32_t)tiles[t].roots.size();
+    uint32_t nodes = first_node[tiles.size()];
+    std::vector<int> tile_of(nodes);
+    for (size_t t = 0; t < tiles.size(); ++t)
+        std::fill(tile_of.begin() + first_node[t], tile_of.begin() + first_node[t + 1], (int)t);
+
+    // border cells by mosaic position, several per position where tiles overlap
+    std::unordered_multimap<uint64_t, uint32_t> border;
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        const MosaicTile& tile = tiles[t];
+        for (size_t r = 0; r < tile.roots.size(); ++r) {
+            const MosaicRoot& root = tile.roots[r];
+            if (root.x == 0 || root.y == 0 || root.x == tile.width - 1 || root.y == tile.height - 1)
+                border.insert(std::make_pair((uint64_t)(uint32_t)(tile.y0 + root.y) << 32 | (uint32_t)(tile.x0 + root.x), first_node[t] + (uint32_t)r));
+        }
+    }
+
+    // spills inside the tiles and across the seams; a border cell with a neighbour outside its
+    // tile that no other tile has is at the mosaic border or at nodata and stays an outlet
+    std::vector<MosaicSpill> edges;
+    std::vector<char> outlet(nodes, 0);
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        const MosaicTile& tile = tiles[t];
+        for (size_t s = 0; s < tile.spills.size(); ++s) {
+            MosaicSpill edge = { first_node[t] + tile.spills[s].u, first_node[t] + tile.spills[s].v, tile.spills[s].level_u, tile.spills[s].level_v, (int)s };
+            edges.push_back(edge);
+        }
+        for (size_t r = 0; r < tile.roots.size(); ++r) {
+            const MosaicRoot& root = tile.roots[r];
+            uint32_t node = first_node[t] + (uint32_t)r;
+            outlet[node] = root.outlet;
+            for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                    int x = root.x + dx, y = root.y + dy;
+                    if (x >= 0 && y >= 0 && x < tile.width && y < tile.height)
+                        continue;
+                    auto range = border.equal_range((uint64_t)(uint32_t)(tile.y0 + y) << 32 | (uint32_t)(tile.x0 + x));
+                    bool found = false;
+                    for (auto other = range.first; other != range.second; ++other) {
+                        if (tile_of[other->second] == (int)t)
+                            continue;
+                        found = true;
+                        // each pair once, from the lower node
+                        if (other->second < node)
+                            continue;
+                        MosaicSpill edge = { node, other->second, root.elevation,
+                            tiles[tile_of[other->second]].roots[other->second - first_node[tile_of[other->second]]].elevation, -1 };
+                        edges.push_back(edge);
+                    }
+                    if (!found)
+                        outlet[node] = 1;
+                }
+            }
+        }
+    }
+    std::vector<uint64_t> first((size_t)nodes + 1, 0);
+    for (size_t e = 0; e < edges.size(); ++e) {
+        first[edges[e].u + 1]++;
+        first[edges[e].v + 1]++;
+    }
+    for (uint32_t n = 0; n < nodes; ++n)
+        first[n + 1] += first[n];
+    std::vector<uint64_t> adjacent(first[nodes]);
+    std::vector<uint64_t> fill(first.begin(), first.end() - 1);
+    for (size_t e = 0; e < edges.size(); ++e) {
+        adjacent[fill[edges[e].u]++] = e;
+        adjacent[fill[edges[e].v]++] = e;
+    }
+    std::vector<uint64_t>().swap(fill);
+
+    // priority flood over the roots from the outlets. Of the spills reaching a root at the same
+    // level the one with the lower cell on the flooded side wins, as that cell comes out of the
+    // queue first in one flood of the whole DEM.
+    std::vector<double> level(nodes, HUGE_VAL), side(nodes, HUGE_VAL);
+    std::vector<uint64_t> parent(nodes, OUTSIDE);
+    std::vector<char> done(nodes, 0);
+    std::vector<uint32_t> flooded; // roots in the order they were flooded
+    std::priority_queue<FloodEntry> queue;
+    for (uint32_t node = 0; node < nodes; ++node) {
+        if (!outlet[node])
+            continue;
+        level[node] = tiles[tile_of[node]].roots[node - first_node[tile_of[node]]].elevation;
+        side[node] = -HUGE_VAL;
+        FloodEntry seed = { level[node], node, node };
+        queue.push(seed);
+    }
+    while (!queue.empty()) {
+        FloodEntry top = queue.top();
+        queue.pop();
+        if (done[top.id])
+            continue;
+        done[top.id] = 1;
+        flooded.push_back(top.id);
+        for (uint64_t a = first[top.id]; a < first[top.id + 1]; ++a) {
+            const MosaicSpill& edge = edges[adjacent[a]];
+            uint32_t other = edge.u == top.id ? edge.v : edge.u;
+            double from = std::max(top.level, edge.u == top.id ? edge.level_u : edge.level_v);
+            double reach = std::max(from, edge.u == top.id ? edge.level_v : edge.level_u);
+            if (done[other] || reach > level[other] || (reach == level[other] && from >= side[other]))
+                continue;
+            if (reach < level[other]) {
+                FloodEntry next = { reach, other, other };
+                queue.push(next);
+            }
+            level[other] = reach;
+            side[other] = from;
+            parent[other] = adjacent[a];
+        }
+    }
+
+    // water leaving every root, from the last flooded root back to the first
+    std::vector<double> total(nodes);
+    for (uint32_t node = 0; node < nodes; ++node)
+        total[node] = tiles[tile_of[node]].roots[node - first_node[tile_of[node]]].outflow;
+    std::vector<MosaicInflow> result(tiles.size());
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        result[t].inflow.assign(tiles[t].roots.size(), 0);
+        result[t].link_dir.assign(tiles[t].roots.size(), 0);
+        result[t].spill.assign(tiles[t].roots.size(), -1);
+    }
+    for (size_t i = flooded.size(); i-- > 0;) {
+        uint32_t node = flooded[i];
+        if (parent[node] == OUTSIDE)
+            continue;
+        const MosaicSpill& edge = edges[parent[node]];
+        uint32_t target = edge.u == node ? edge.v : edge.u;
+        int t = tile_of[node], t2 = tile_of[target];
+        total[target] += total[node];
+        if (edge.spill >= 0) {
+            result[t].spill[node - first_node[t]] = edge.spill;
+            continue;
+        }
+        const MosaicRoot& from = tiles[t].roots[node - first_node[t]];
+        const MosaicRoot& to = tiles[t2].roots[target - first_node[t2]];
+        result[t].link_dir[node - first_node[t]] = flow_code(tiles[t2].x0 + to.x - tiles[t].x0 - from.x, tiles[t2].y0 + to.y - tiles[t].y0 - from.y);
+        result[t2].inflow[target - first_node[t2]] += total[node];
+    }
+    unlinked = nodes - flooded.size();
+    return result;
+}
+
+// Weight source of the second pass over a tile: every cell plus the water entering the tile there
+struct InflowWeight {
+    static const bool lossy = false;
+    const Raster<double>* inflow;
+
+    InflowWeight(const Raster<double>* inflow) {
+        this->inflow = inflow;
+    }
+
+    double operator()(int x, int y) const { return 1 + (*inflow)(x, y); }
+
+    double retained(int, int) const { return 1; }
+};
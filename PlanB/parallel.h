@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+
+// Number of worker threads to use when none is given
+inline int default_threads() {
+    int n = (int)std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// Run job(i) for i in [0, n) on a pool of threads. Jobs are handed out one at a time,
+// so which thread runs which job varies between runs; jobs must only write their own data.
+template <typename Job>
+void parallel_for(int n, int threads, Job job) {
+    if (threads <= 1 || n <= 1) {
+        for (int i = 0; i < n; ++i)
+            job(i);
+        return;
+    }
+    std::atomic<int> next(0);
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads && t < n; ++t) {
+        pool.emplace_back([&]() {
+            for (int i = next++; i < n; i = next++)
+                job(i);
+        });
+    }
+    for (size_t t = 0; t < pool.size(); ++t)
+        pool[t].join();
+}
+
+// Queue between two stages of a pipeline holding at most capacity items. push waits while the
+// queue is full and pop while it is empty, so the producer never runs more than capacity items
+// ahead of the consumer. close ends the stream: pop returns false once the rest is taken.
+template <typename T>
+struct BoundedQueue {
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+    std::mutex lock;
+    std::condition_variable changed;
+
+    BoundedQueue(size_t capacity) {
+        this->capacity = capacity;
+    }
+
+    void push(T item) {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&]() { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        changed.notify_all();
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&]() { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        changed.notify_all();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        changed.notify_all();
+    }
+};
@@ -0,0 +1,91 @@
+#pragma once
+#include <queue>
+#include <vector>
+#include <cstdint>
+
+#include "raster.h"
+
+
+// Level an entry is ordered by in the flood queues
+inline double queue_level(const RasterCell& cell) {
+    return cell.elevation;
+}
+
+// Comparison based flood queue, for any range of levels. Lowest level first, ties go to the
+// entry its operator< ranks first.
+template <typename Entry>
+struct HeapQueue : std::priority_queue<Entry> {
+    HeapQueue(double, double) {}
+
+    // Call visit(entry) for every entry, in no particular order
+    template <typename Visit>
+    void for_each(Visit visit) const {
+        for (size_t i = 0; i < this->c.size(); ++i)
+            visit(this->c[i]);
+    }
+};
+
+// Widest range of levels a BucketQueue is used for, wider ranges fall back to the heap
+const int64_t MAX_BUCKETS = 1 << 24;
+
+inline bool bucket_range_ok(double min_level, double max_level) {
+    return max_level - min_level < MAX_BUCKETS;
+}
+
+// Flood queue for integer levels (integer elevation types only): one FIFO bucket per level and a cursor on the lowest bucket
+// that may hold entries, so push and pop are O(1) apart from moving the cursor over empty
+// buckets. Entries of the same level come out in the order they were pushed, which is the
+// order the heap gives them when ties are broken on an increasing insertion order, so both
+// queues flood the same way. Pushing below the cursor (a pit) moves the cursor back down.
+template <typename Entry>
+struct BucketQueue {
+    std::vector<std::vector<Entry> > buckets;
+    std::vector<size_t> head; // next entry to pop in each bucket
+    double min_level;
+    mutable size_t current; // lowest bucket that may not be empty
+    size_t count;
+
+    BucketQueue(double min_level, double max_level) {
+        size_t levels = max_level >= min_level ? (size_t)(max_level - min_level + 1) : 1;
+        buckets.resize(levels);
+        head.assign(levels, 0);
+        this->min_level = min_level;
+        current = levels;
+        count = 0;
+    }
+
+    void push(const Entry& entry) {
+        size_t b = (size_t)(queue_level(entry) - min_level);
+        buckets[b].push_back(entry);
+        if (b < current)
+            current = b;
+        count++;
+    }
+
+    const Entry& top() const {
+        while (head[current] == buckets[current].size())
+            current++;
+        return buckets[current][head[current]];
+    }
+
+    void pop() {
+        top();
+        count--;
+        if (++head[current] == buckets[current].size()) {
+            buckets[current].clear();
+            head[current] = 0;
+        }
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    // Call visit(entry) for every entry, in no particular order
+    template <typename Visit>
+    void for_each(Visit visit) const {
+        for (size_t b = 0; b < buckets.size(); ++b)
+            for (size_t i = head[b]; i < buckets[b].size(); ++i)
+                visit(buckets[b][i]);
+    }
+};
@@ -0,0 +1,467 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+#include <unordered_map>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "memory.h"
+
+
+// A structure that links to a single cell in a Raster
+struct RasterCell {
+    int x, y; // row and column of the cell
+    double elevation; // any elevation type converts exactly, so comparisons and ties are exact
+    uint64_t insertion_order; // tie-break between equal elevations, 64 bits so it does not wrap on huge grids
+    bool add_to_list;
+    int flow_dir;
+    int accumulation = 0;
+
+    // Defines a new link to a cell
+    RasterCell(int x, int y, double elevation, uint64_t insert_order, int dir) {
+        this->x = x;
+        this->y = y;
+        this->elevation = elevation;
+        this->insertion_order = insert_order;
+        this->flow_dir = dir;
+    }
+
+    // Define the order of the linked cells (to be used in a priority_queue)
+    bool operator<(const RasterCell& other) const {
+        // to do with statements like if (this->elevation > other.elevation) return false/true;
+        if (this->elevation == other.elevation)
+        {
+            if (this->insertion_order < other.insertion_order)
+                return false;
+            else if (this->insertion_order > other.insertion_order)
+                return true;
+        }
+        else if (this->elevation <= other.elevation)
+            return false;
+        else if (this->elevation > other.elevation)
+            return true;
+
+    }
+};
+
+// Cell of the accumulation order (every cell after the cell it drains to), its position only:
+// 8 bytes a cell where a RasterCell takes 40
+struct CellPosition {
+    int x, y;
+
+    CellPosition(int x, int y) {
+        this->x = x;
+        this->y = y;
+    }
+};
+
+// Compact storage of raster values
+//
+// A Raster keeps its values in a Store, RasterVector<T> by default. The stores below have the
+// same interface for what Raster uses with less memory per cell. Their operator[] returns a
+// StoreRef in place of a reference, which reads and writes through get and set.
+
+template <typename Store, typename T>
+struct StoreRef {
+    Store* store;
+    size_t i;
+
+    StoreRef(Store* store, size_t i) {
+        this->store = store;
+        this->i = i;
+    }
+
+    // a copy refers to the same cell, assigning one StoreRef to another copies the value
+    StoreRef(const StoreRef&) = default;
+
+    operator T() const { return store->get(i); }
+
+    StoreRef& operator=(T value) {
+        store->set(i, value);
+        return *this;
+    }
+
+    StoreRef& operator=(const StoreRef& other) {
+        store->set(i, (T)other);
+        return *this;
+    }
+
+    StoreRef& operator+=(T value) {
+        store->set(i, store->get(i) + value);
+        return *this;
+    }
+};
+
+// Members shared by the compact stores, Derived gives get, set and the storage
+template <typename Derived, typename T>
+struct CompactStore {
+    typedef T value_type;
+    typedef StoreRef<Derived, T> reference;
+
+    reference operator[](size_t i) {
+        return reference(static_cast<Derived*>(this), i);
+    }
+
+    T operator[](size_t i) const {
+        return static_cast<const Derived*>(this)->get(i);
+    }
+
+    void push_back(T value) {
+        Derived* self = static_cast<Derived*>(this);
+        self->resize(self->size() + 1);
+        self->set(self->size() - 1, value);
+    }
+
+    void assign(size_t n, T value) {
+        Derived* self = static_cast<Derived*>(this);
+        self->clear();
+        self->zero(n);
+        if (value != 0)
+            for (size_t i = 0; i < n; ++i)
+                self->set(i, value);
+    }
+};
+
+// Flow directions (0, 10, ..., 80) in one byte per cell
+struct ByteDirections : CompactStore<ByteDirections, unsigned int> {
+    RasterVector<uint8_t> codes; // direction / 10
+
+    unsigned int get(size_t i) const { return codes[i] * 10u; }
+    void set(size_t i, unsigned int dir) { codes[i] = (uint8_t)(dir / 10); }
+    size_t size() const { return codes.size(); }
+    void resize(size_t n) { codes.resize(n, 0); }
+    void zero(size_t n) { zero_fill(codes, n); }
+    void reserve(size_t n) { codes.reserve(n); }
+    void clear() { codes.clear(); }
+    bool operator==(const ByteDirections& other) const { return codes == other.codes; }
+};
+
+// Flow directions in four bits per cell, two cells per byte. Neighbouring cells share a byte,
+// so two threads must not write cells next to each other.
+struct PackedDirections : CompactStore<PackedDirections, unsigned int> {
+    RasterVector<uint8_t> codes; // direction / 10 of cell 2k in the low and 2k + 1 in the high half
+    size_t count = 0;
+
+    unsigned int get(size_t i) const { return ((codes[i >> 1] >> ((i & 1) * 4)) & 15) * 10u; }
+
+    void set(size_t i, unsigned int dir) {
+        int shift = (i & 1) * 4;
+        codes[i >> 1] = (uint8_t)((codes[i >> 1] & ~(15 << shift)) | ((dir / 10) << shift));
+    }
+
+    size_t size() const { return count; }
+
+    void resize(size_t n) {
+        codes.resize((n + 1) / 2, 0);
+        count = n;
+    }
+
+    void zero(size_t n) {
+        zero_fill(codes, (n + 1) / 2);
+        count = n;
+    }
+
+    void reserve(size_t n) { codes.reserve((n + 1) / 2); }
+
+    void clear() {
+        codes.clear();
+        count = 0;
+    }
+
+    bool operator==(const PackedDirections& other) const { return count == other.count && codes == other.codes; }
+};
+
+// Whether cells of a store share bytes (and so can't be written from several threads)
+template <typename Store> struct store_shares_bytes { static const bool value = false; };
+template <> struct store_shares_bytes<PackedDirections> { static const bool value = true; };
+
+// Integer counts in one byte per cell. Counts from 255 up, few in an accumulation grid, are
+// kept in a hash map and the byte is set to 255 to say so.
+template <typename T>
+struct CompactCounts : CompactStore<CompactCounts<T>, T> {
+    RasterVector<uint8_t> small;
+    std::unordered_map<size_t, T> large;
+
+    T get(size_t i) const { return small[i] == 255 ? large.find(i)->second : small[i]; }
+
+    void set(size_t i, T value) {
+        if (value < 255) {
+            if (small[i] == 255)
+                large.erase(i);
+            small[i] = (uint8_t)value;
+        }
+        else {
+            small[i] = 255;
+            large[i] = value;
+        }
+    }
+
+    size_t size() const { return small.size(); }
+    void resize(size_t n) { small.resize(n, 0); }
+    void zero(size_t n) { zero_fill(small, n); }
+    void reserve(size_t n) { small.reserve(n); }
+
+    void clear() {
+        small.clear();
+        large.clear();
+    }
+};
+
+// Make a store n zeros
+template <typename T>
+void zero_store(RasterVector<T>& store, size_t n) {
+    zero_fill(store, n);
+}
+
+template <typename Derived, typename T>
+void zero_store(CompactStore<Derived, T>& store, size_t n) {
+    store.assign(n, 0);
+}
+
+// Tiles of the tiled layout are 2^TILE_LAYOUT_SHIFT = 64 cells a side
+const int TILE_LAYOUT_SHIFT = 6;
+
+// Storage and access of a raster of a given size
+//
+// Cells are stored row by row, or in the tiled layout in square tiles of 2^tile_shift cells
+// a side, tile after tile and row by row inside a tile. The flood and the accumulation go
+// from a cell to its neighbours in elevation order, not in row order, and in wide rasters
+// the rows above and below are then far away in memory. In a tile they are close, so most
+// neighbour steps stay in the same few pages. The last tiles of a row and column are padded.
+template <typename T = unsigned int, typename Store = RasterVector<T> >
+struct Raster {
+    Store pixels; // where everything is stored
+    RasterVector<uint8_t> visiting; // store information about if the cell is visited
+    RasterVector<uint8_t> in_queue; // store information about if the cell is added to the priority queue
+
+
+    int max_x, max_y; // number of columns and rows
+    int direction;
+    int tile_shift = 0; // 0 for rows, tiles of 2^tile_shift cells a side otherwise
+    int tiles_x = 0; // tiles in a row of tiles
+
+
+    // Initialise a raster with x columns and y rows
+    Raster(int x = 0, int y = 0) {
+        max_x = x;
+        max_y = y;
+        size_t total_pixels = (size_t)x * y;
+        pixels.reserve(total_pixels);
+        visiting.reserve(total_pixels);
+
+    }
+
+    // Use the raster for another size, keeping the memory it already has for the next fill
+    void reset(int x, int y) {
+        max_x = x;
+        max_y = y;
+        tiles_x = tile_shift == 0 ? 0 : (x + (1 << tile_shift) - 1) >> tile_shift;
+        pixels.clear();
+        visiting.clear();
+        in_queue.clear();
+    }
+
+    // Store the cells in rows (0) or in tiles of 2^shift cells a side from the next fill on
+    void set_layout(int shift) {
+        tile_shift = shift;
+        reset(max_x, max_y);
+    }
+
+    // Number of values stored, padding of the last tiles included
+    size_t cell_count() const {
+        if (tile_shift == 0)
+            return (size_t)max_x * max_y;
+        size_t tiles_y = ((size_t)max_y + (1 << tile_shift) - 1) >> tile_shift;
+        return ((size_t)tiles_x * tiles_y) << (2 * tile_shift);
+    }
+
+    // Fill values of an entire row, rows layout only
+    void add_scanline(const T* line) {
+        for (int i = 0; i < max_x; ++i)
+            pixels.push_back(line[i]);
+    }
+
+    // Fill entire raster with zeros
+    void fill() {
+        zero_store(pixels, cell_count());
+    }
+
+    // Fill the entire raster with 0 in visiting and in_queue vector
+    void fill_visit() {
+        zero_fill(visiting, cell_count());
+        zero_fill(in_queue, cell_count());
+    }
+
+    // Position of a cell in pixels
+    size_t index(int x, int y) const {
+        if (tile_shift == 0)
+            return (size_t)y * max_x + x;
+        int inside = (1 << tile_shift) - 1;
+        size_t tile = (size_t)(y >> tile_shift) * tiles_x + (x >> tile_shift);
+        return (tile << (2 * tile_shift)) | ((size_t)(y & inside) << tile_shift) | (size_t)(x & inside);
+    }
+
+    // Number of a cell counted row by row, the same in every layout
+    uint64_t cell_id(int x, int y) const {
+        return (uint64_t)y * max_x + x;
+    }
+
+
+    // Access the value of a raster cell to read or write it
+    typename Store::reference operator()(int x, int y) {
+        assert(x >= 0 && x < max_x);
+        assert(y >= 0 && y < max_y);
+        return pixels[index(x, y)];
+    }
+
+    // Access the value of a raster cell to read it
+    T operator()(int x, int y) const {
+        assert(x >= 0 && x < max_x);
+        assert(y >= 0 && y < max_y);
+        return pixels[index(x, y)];
+    }
+
+    // Add pixel value for output raster
+    void add_value(int x1, int y1, T value) {
+        assert(x1 >= 0 && x1 < max_x);
+        assert(y1 >= 0 && y1 < max_y);
+        pixels[index(x1, y1)] = value;
+
+    }
+
+    //change the status from unvisited to visited
+    void Is_Visited(int x1, int y1) {
+        visiting[index(x1, y1)] = 1;
+    }
+
+    // return the status of the pixel whether visited.
+    int If_Visited(int x1, int y1) {
+        return visiting[index(x1, y1)];
+    }
+
+    // update the status after add to the cell_to_process_flow queue
+    void Add_to_queue(int x, int y) {
+        in_queue[index(x, y)] = 1;
+    }
+
+    // check the status whether add to the cell_to_process_flow queue
+    int If_add_to_queue(int x, int y) {
+        return in_queue[index(x, y)];
+    }
+
+    void output_accumulation(int& current_line, T* line)
+    {
+        for (int i = 0; i < max_y; ++i)
+            line[i] = pixels[i + (size_t)current_line * max_y];
+    }
+};
+
+// Index of the lowest set bit of a non zero word
+inline int lowest_bit(uint64_t word) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (int)index;
+#else
+    return __builtin_ctzll(word);
+#endif
+}
+
+// Cells without data (the NODATA value of the DEM), one bit per cell. Every row starts on a
+// new word, so runs of nodata can be skipped 64 cells at a time. An empty mask has no nodata.
+struct NodataMask {
+    int max_x = 0, max_y = 0;
+    size_t words_per_row = 0;
+    RasterVector<uint64_t> bits;
+
+    // Mask the cells of input_raster equal to nodata (or NaN cells for a NaN nodata), false
+    // (and empty) when there are none
+    template <typename T, typename Store>
+    bool build(const Raster<T, Store>& input_raster, T nodata) {
+        max_x = input_raster.max_x;
+        max_y = input_raster.max_y;
+        words_per_row = ((size_t)max_x + 63) / 64;
+        bits.assign(words_per_row * max_y, 0);
+        bool any = false;
+        bool nan = nodata != nodata;
+        for (int y = 0; y < max_y; ++y) {
+            for (int x = 0; x < max_x; ++x) {
+                T z = input_raster(x, y);
+                if (z == nodata || (nan && z != z)) {
+                    bits[y * words_per_row + (x >> 6)] |= (uint64_t)1 << (x & 63);
+                    any = true;
+                }
+            }
+        }
+        if (!any)
+            clear();
+        return any;
+    }
+
+    void clear() {
+        bits.clear();
+        words_per_row = 0;
+    }
+
+    bool empty() const {
+        return bits.empty();
+    }
+
+    bool operator()(int x, int y) const {
+        return (bits[y * words_per_row + (x >> 6)] >> (x & 63)) & 1;
+    }
+
+    // Word of row y holding cells 64 * w to 64 * w + 63, zero outside the raster
+    uint64_t word(int y, long long w) const {
+        if (y < 0 || y >= max_y || w < 0 || w >= (long long)words_per_row)
+            return 0;
+        return bits[y * words_per_row + w];
+    }
+};
+
+// Is (x, y) masked, for an optional mask
+inline bool is_masked(const NodataMask* mask, int x, int y) {
+    return mask != NULL && (*mask)(x, y);
+}
+
+// Call visit(x, y) for the unmasked cells in [x0, x1] x [y0, y1] that have a masked cell among
+// their 8 neighbours, row by row. The mask is dilated a word at a time, so whole words of
+// nodata or of data cost one step.
+template <typename Visit>
+void for_each_mask_border(const NodataMask& mask, int x0, int y0, int x1, int y1, Visit visit) {
+    for (int y = y0; y <= y1; ++y) {
+        for (long long w = x0 >> 6; w <= (x1 >> 6); ++w) {
+            uint64_t near = 0;
+            for (int dy = -1; dy <= 1; ++dy) {
+                uint64_t m = mask.word(y + dy, w);
+                near |= m | (m << 1) | (m >> 1) | (mask.word(y + dy, w - 1) >> 63) | (mask.word(y + dy, w + 1) << 63);
+            }
+            uint64_t cells = near & ~mask.word(y, w);
+            while (cells != 0) {
+                int x = (int)(w * 64 + lowest_bit(cells));
+                cells &= cells - 1;
+                if (x >= x0 && x <= x1)
+                    visit(x, y);
+            }
+        }
+    }
+}
+
+// Move (x, y) to the cell its flow direction code points at, false for outlets (0)
+inline bool flow_target(int dir, int& x, int& y) {
+    switch (dir)
+    {
+    case 10: x -= 1; y -= 1; return true;
+    case 20: y -= 1; return true;
+    case 30: x += 1; y -= 1; return true;
+    case 40: x -= 1; return true;
+    case 50: x += 1; return true;
+    case 60: x -= 1; y += 1; return true;
+    case 70: y += 1; return true;
+    case 80: x += 1; y += 1; return true;
+    default: return false;
+    }
+}
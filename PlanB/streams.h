@@ -0,0 +1,191 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <iostream>
+#include <algorithm>
+
+#include "raster.h"
+#include "parallel.h"
+#include "cellsize.h"
+
+
+// Stream networks of many channel initiation thresholds from one sorted index
+//
+// A stream cell has at least threshold cells upstream of it, so the streams of a threshold are
+// the first cells of the flooded cells sorted by upstream count, largest first, and lowering
+// the threshold only appends cells. The cells are sorted once (a parallel radix sort) and the
+// thresholds are then swept from the highest down, adding the cells each one brings to the
+// stream length and link count. Links start at sources and confluences. A cell added has no
+// stream cell upstream of it yet (those have fewer cells upstream), so it is a source, and the
+// cell it drains to is already in the network: it gains an inflow, which ends it being a source
+// with the first and makes it a confluence with the second. Every cell is added once for the
+// whole sweep, whatever the number of thresholds.
+
+// Flooded cells sorted by the cells upstream of them
+struct StreamIndex {
+    int max_x = 0, max_y = 0;
+    std::vector<uint32_t> upstream; // cells upstream of every cell, itself not included
+    std::vector<uint32_t> cells; // cell_id of the flooded cells, most cells upstream first, ties by cell_id
+    double area = 0; // of the flooded cells, in the units of the CellSizes
+};
+
+// Stream network of one threshold
+struct StreamNetwork {
+    uint32_t threshold = 0;
+    uint64_t cells = 0;
+    uint64_t links = 0; // stretches of stream between sources, confluences and outlets
+    double length = 0; // of the flow paths between stream cells, in the units of the CellSizes
+    double density = 0; // length per area of the DEM
+};
+
+// Sort values by key, stable, with threads workers. LSD radix sort a byte per pass, each
+// worker counting and then scattering its own share, so the order of equal keys is kept.
+inline void radix_sort(std::vector<uint32_t>& keys, std::vector<uint32_t>& values, int threads) {
+    size_t n = keys.size();
+    // bytes that are the same in every key are skipped
+    uint32_t any_set = 0, all_set = UINT32_MAX;
+    for (size_t i = 0; i < n; ++i) {
+        any_set |= keys[i];
+        all_set &= keys[i];
+    }
+    int shares = std::max(1, threads);
+    std::vector<uint32_t> sorted_keys(n), sorted_values(n);
+    std::vector<std::vector<size_t> > counts(shares, std::vector<size_t>(256));
+    for (int shift = 0; shift < 32; shift += 8) {
+        if ((((any_set ^ all_set) >> shift) & 0xff) == 0)
+            continue;
+        parallel_for(shares, shares, [&](int s) {
+            std::fill(counts[s].begin(), counts[s].end(), 0);
+            for (size_t i = n * s / shares; i < n * (s + 1) / shares; ++i)
+                counts[s][(keys[i] >> shift) & 0xff]++;
+        });
+        // where every share writes the keys of every byte value
+        size_t start = 0;
+        for (int b = 0; b < 256; ++b) {
+            for (int s = 0; s < shares; ++s) {
+                size_t count = counts[s][b];
+                counts[s][b] = start;
+                start += count;
+            }
+        }
+        parallel_for(shares, shares, [&](int s) {
+            for (size_t i = n * s / shares; i < n * (s + 1) / shares; ++i) {
+                size_t to = counts[s][(keys[i] >> shift) & 0xff]++;
+                sorted_keys[to] = keys[i];
+                sorted_values[to] = values[i];
+            }
+        });
+        keys.swap(sorted_keys);
+        values.swap(sorted_values);
+    }
+}
+
+const uint32_t NOT_FLOODED = UINT32_MAX; // upstream count of cells that were not flooded (nodata)
+
+// Index of a flooded DEM, false when it has too many cells for one. cells_to_process_accumulation
+// holds every flooded cell after the cell it drains to.
+template <typename DirStore>
+bool build_stream_index(const std::deque<CellPosition>& cells_to_process_accumulation, const Raster<unsigned int, DirStore>& flow_direction,
+    const CellSizes& sizes, int threads, StreamIndex& index) {
+    int max_x = flow_direction.max_x, max_y = flow_direction.max_y;
+    if ((uint64_t)max_x * max_y >= NOT_FLOODED) {
+        std::cerr << "Too many cells for a stream index" << std::endl;
+        return false;
+    }
+    index.max_x = max_x;
+    index.max_y = max_y;
+    index.upstream.assign((size_t)max_x * max_y, NOT_FLOODED);
+    index.area = 0;
+    for (auto cell = cells_to_process_accumulation.begin(); cell != cells_to_process_accumulation.end(); ++cell) {
+        index.upstream[flow_direction.cell_id(cell->x, cell->y)] = 0;
+        index.area += sizes.area(cell->y);
+    }
+    for (auto cell = cells_to_process_accumulation.rbegin(); cell != cells_to_process_accumulation.rend(); ++cell) {
+        int down_x = cell->x, down_y = cell->y;
+        if (flow_target(flow_direction(cell->x, cell->y), down_x, down_y))
+            index.upstream[flow_direction.cell_id(down_x, down_y)] += index.upstream[flow_direction.cell_id(cell->x, cell->y)] + 1;
+    }
+
+    // row by row, so equal counts stay in cell_id order; inverted keys sort the largest first
+    std::vector<uint32_t> keys;
+    keys.reserve(cells_to_process_accumulation.size());
+    index.cells.clear();
+    index.cells.reserve(cells_to_process_accumulation.size());
+    for (uint32_t id = 0; id < (uint32_t)index.upstream.size(); ++id) {
+        if (index.upstream[id] != NOT_FLOODED) {
+            keys.push_back(~index.upstream[id]);
+            index.cells.push_back(id);
+        }
+    }
+    radix_sort(keys, index.cells, threads);
+    return true;
+}
+
+// Networks of every threshold of thresholds, in the order given. The cell a stream cell drains
+// to has more cells upstream, so it is always in the network before it.
+template <typename DirStore>
+void sweep_streams(const StreamIndex& index, const Raster<unsigned int, DirStore>& flow_direction, const CellSizes& sizes,
+    const std::vector<uint32_t>& thresholds, std::vector<StreamNetwork>& networks) {
+    std::vector<size_t> by_threshold(thresholds.size());
+    for (size_t t = 0; t < thresholds.size(); ++t)
+        by_threshold[t] = t;
+    std::sort(by_threshold.begin(), by_threshold.end(), [&](size_t a, size_t b) { return thresholds[a] > thresholds[b]; });
+
+    // stream cells flowing into every cell; a link starts at a cell with none (a source) and at
+    // one with two or more (a confluence)
+    std::vector<uint8_t> inflows((size_t)index.max_x * index.max_y, 0);
+    auto links_of = [](int k) { return k == 1 ? 0 : 1; };
+    networks.assign(thresholds.size(), StreamNetwork());
+    StreamNetwork network;
+    size_t next = 0;
+    for (size_t t = 0; t < by_threshold.size(); ++t) {
+        uint32_t threshold = thresholds[by_threshold[t]];
+        for (; next < index.cells.size() && index.upstream[index.cells[next]] >= threshold; ++next) {
+            uint32_t id = index.cells[next];
+            int x = (int)(id % index.max_x), y = (int)(id / index.max_x);
+            int dir = flow_direction(x, y);
+            network.cells += 1;
+            network.links += 1;
+            int down_x = x, down_y = y;
+            if (flow_target(dir, down_x, down_y)) {
+                uint8_t& k = inflows[flow_direction.cell_id(down_x, down_y)];
+                network.links += links_of(k + 1) - links_of(k);
+                k++;
+                network.length += sizes.step(y, dir);
+            }
+        }
+        network.threshold = threshold;
+        network.density = index.area > 0 ? network.length / index.area : 0;
+        networks[by_threshold[t]] = network;
+    }
+}
+
+// Stream cells of threshold, 1 in stream, set from the first cells of the index only
+inline void stream_mask(const StreamIndex& index, uint32_t threshold, Raster<int16_t>& streams) {
+    streams.reset(index.max_x, index.max_y);
+    streams.fill();
+    for (size_t i = 0; i < index.cells.size() && index.upstream[index.cells[i]] >= threshold; ++i)
+        streams((int)(index.cells[i] % index.max_x), (int)(index.cells[i] / index.max_x)) = 1;
+}
+
+// Write the networks to a CSV file, one row per threshold
+inline bool write_stream_sweep(const std::string& filename, const std::vector<StreamNetwork>& networks) {
+    FILE* file = fopen(filename.c_str(), "w");
+    if (file == NULL) {
+        std::cerr << "Couldn't write " << filename << std::endl;
+        return false;
+    }
+    fprintf(file, "threshold,cells,links,length,drainage_density\n");
+    for (size_t t = 0; t < networks.size(); ++t) {
+        const StreamNetwork& network = networks[t];
+        fprintf(file, "%u,%llu,%llu,%.10g,%.10g\n", network.threshold, (unsigned long long)network.cells,
+            (unsigned long long)network.links, network.length, network.density);
+    }
+    bool ok = fclose(file) == 0;
+    if (!ok)
+        std::cerr << "Couldn't write " << filename << std::endl;
+    return ok;
+}
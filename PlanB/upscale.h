@@ -0,0 +1,104 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+#include "raster.h"
+#include "flood.h"
+#include "parallel.h"
+#include "cellsize.h"
+
+
+// Flow directions of a coarse grid traced from the fine directions (COTAT)
+//
+// Resampling a direction raster breaks the rivers: the coarse cell takes whatever direction a
+// fine cell happens to have. Instead every coarse cell of factor x factor fine cells gets an
+// outlet, its fine cell with the largest upstream area, and the flow path of that outlet is
+// followed down the fine directions. The coarse cell drains to the neighbour where the path
+// reaches the outlet of another coarse cell, or where the area gained since leaving the cell
+// passes the area of one coarse cell, so small side cells the river only clips are passed.
+// A path that leaves the 3x3 neighbourhood or the DEM first drains to the last neighbour it
+// went through. A coarse cell only ever drains to one holding a larger upstream area than any
+// of its own cells, so the coarse directions have no loops. The upstream area of a coarse cell
+// is that of its outlet, the area the regional model routes.
+//
+// The coarse cells are independent of each other and are traced in parallel, a row of coarse
+// cells per job. Every level of a pyramid is traced from the fine grid, not from the level
+// below it, so the errors of one level are not carried into the next.
+
+// Upstream area of every cell of a flooded DEM, the cell itself included, in the units of the
+// CellSizes. Cells that were not flooded (nodata) are left at 0.
+template <typename DirStore>
+void upstream_areas(const std::deque<CellPosition>& cells_to_process_accumulation, const Raster<unsigned int, DirStore>& flow_direction,
+    const CellSizes& sizes, Raster<double>& area) {
+    area.set_layout(flow_direction.tile_shift);
+    area.reset(flow_direction.max_x, flow_direction.max_y);
+    area.fill();
+    for (auto cell = cells_to_process_accumulation.rbegin(); cell != cells_to_process_accumulation.rend(); ++cell) {
+        area(cell->x, cell->y) += sizes.area(cell->y);
+        int down_x = cell->x, down_y = cell->y;
+        if (flow_target(flow_direction(cell->x, cell->y), down_x, down_y))
+            area(down_x, down_y) += area(cell->x, cell->y);
+    }
+}
+
+// Coarse directions and upstream areas of factor x factor blocks of the fine grid. Blocks at
+// the right and bottom edge may be smaller. Blocks without a flooded cell drain nowhere (0)
+// with an area of 0.
+template <typename DirStore>
+void upscale_directions(const Raster<unsigned int, DirStore>& flow_direction, const Raster<double>& area, const CellSizes& sizes,
+    int factor, int threads, Raster<unsigned int>& coarse_direction, Raster<double>& coarse_area) {
+    int max_x = flow_direction.max_x, max_y = flow_direction.max_y;
+    int coarse_x = (max_x + factor - 1) / factor, coarse_y = (max_y + factor - 1) / factor;
+    coarse_direction.reset(coarse_x, coarse_y);
+    coarse_direction.fill();
+    coarse_area.reset(coarse_x, coarse_y);
+    coarse_area.fill();
+
+    // outlet of every block, the first cell of largest upstream area row by row
+    std::vector<uint64_t> outlet((size_t)coarse_x * coarse_y, 0);
+    parallel_for(coarse_y, std::max(1, threads), [&](int cy) {
+        for (int cx = 0; cx < coarse_x; ++cx) {
+            double largest = 0;
+            uint64_t best = 0;
+            for (int y = cy * factor; y < std::min(max_y, (cy + 1) * factor); ++y) {
+                for (int x = cx * factor; x < std::min(max_x, (cx + 1) * factor); ++x) {
+                    if (area(x, y) > largest) {
+                        largest = area(x, y);
+                        best = flow_direction.cell_id(x, y);
+                    }
+                }
+            }
+            outlet[(size_t)cy * coarse_x + cx] = best;
+            coarse_area(cx, cy) = largest;
+        }
+    });
+
+    parallel_for(coarse_y, std::max(1, threads), [&](int cy) {
+        // area of a coarse cell of this row
+        double threshold = 0;
+        for (int y = cy * factor; y < std::min(max_y, (cy + 1) * factor); ++y)
+            threshold += factor * sizes.area(y);
+        for (int cx = 0; cx < coarse_x; ++cx) {
+            if (coarse_area(cx, cy) == 0)
+                continue;
+            uint64_t start = outlet[(size_t)cy * coarse_x + cx];
+            int x = (int)(start % max_x), y = (int)(start / max_x);
+            int last_dx = 0, last_dy = 0; // neighbour the path last went through
+            while (flow_target(flow_direction(x, y), x, y)) {
+                int dx = x / factor - cx, dy = y / factor - cy;
+                if (dx < -1 || dx > 1 || dy < -1 || dy > 1)
+                    break;
+                if (dx == 0 && dy == 0)
+                    continue;
+                last_dx = dx;
+                last_dy = dy;
+                if (flow_direction.cell_id(x, y) == outlet[(size_t)(cy + dy) * coarse_x + cx + dx]
+                    || area(x, y) - coarse_area(cx, cy) > threshold)
+                    break;
+            }
+            coarse_direction(cx, cy) = flow_code(last_dx, last_dy);
+        }
+    });
+}
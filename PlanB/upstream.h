@@ -0,0 +1,228 @@
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <iostream>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "raster.h"
+
+
+// Upstream index of a flow direction raster
+//
+// The directions form a forest: every cell has one downstream cell and the outlets are the
+// roots. The index numbers the cells in depth first pre-order of that forest with every cell's
+// upstream cells after it (nested sets), so the cells upstream of a cell, itself included, are
+// the cells numbered pre to pre + size - 1. "Is a upstream of b" is then a comparison of
+// numbers, and the upstream area is size cells found in one run of the cell array. The index
+// is written as a file of flat arrays that is mapped into memory as it is, so a query service
+// starts without reading or parsing it.
+
+const char UPSTREAM_MAGIC[8] = { 'P', 'B', 'U', 'P', 'I', 'D', 'X', '1' };
+const uint32_t NOT_INDEXED = UINT32_MAX; // cells that were not flooded (nodata)
+
+// Header of an index file, followed by pre and size per cell (row by row) and the cells in
+// pre-order, all uint32_t
+struct UpstreamHeader {
+    char magic[8];
+    int32_t max_x, max_y;
+    uint64_t cells; // cells indexed
+};
+
+// Number the cells of a flooded raster and write the index to filename. order holds every
+// flooded cell after the cell it drains to (the accumulation order of the flood).
+template <typename Store>
+bool write_upstream_index(const std::string& filename, const Raster<unsigned int, Store>& flow_direction, const std::deque<CellPosition>& order) {
+    int max_x = flow_direction.max_x, max_y = flow_direction.max_y;
+    size_t total = (size_t)max_x * max_y;
+    // cell ids are stored as uint32_t too, nodata cells included
+    if ((uint64_t)max_x * max_y >= NOT_INDEXED) {
+        std::cerr << "Too many cells for an upstream index" << std::endl;
+        return false;
+    }
+
+    // cells upstream of every cell, itself included, added up from the sources down
+    std::vector<uint32_t> pre(total, NOT_INDEXED), size(total, 0);
+    for (auto cell = order.rbegin(); cell != order.rend(); ++cell) {
+        uint64_t id = flow_direction.cell_id(cell->x, cell->y);
+        size[id] += 1;
+        int down_x = cell->x, down_y = cell->y;
+        if (flow_target(flow_direction(cell->x, cell->y), down_x, down_y))
+            size[flow_direction.cell_id(down_x, down_y)] += size[id];
+    }
+
+    // a cell comes after its downstream cell in order, which by then knows where the next
+    // of its upstream subtrees starts
+    std::vector<uint32_t> next(total), cells(order.size());
+    uint32_t roots = 0;
+    for (size_t i = 0; i < order.size(); ++i) {
+        int x = order[i].x, y = order[i].y;
+        uint64_t id = flow_direction.cell_id(x, y);
+        int down_x = x, down_y = y;
+        if (flow_target(flow_direction(x, y), down_x, down_y)) {
+            uint64_t down = flow_direction.cell_id(down_x, down_y);
+            pre[id] = next[down];
+            next[down] += size[id];
+        }
+        else {
+            pre[id] = roots;
+            roots += size[id];
+        }
+        next[id] = pre[id] + 1;
+        cells[pre[id]] = (uint32_t)id;
+    }
+
+    UpstreamHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UPSTREAM_MAGIC, sizeof(header.magic));
+    header.max_x = max_x;
+    header.max_y = max_y;
+    header.cells = order.size();
+    FILE* file = fopen(filename.c_str(), "wb");
+    bool ok = file != NULL
+        && fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(pre.data(), sizeof(uint32_t), total, file) == total
+        && fwrite(size.data(), sizeof(uint32_t), total, file) == total
+        && fwrite(cells.data(), sizeof(uint32_t), cells.size(), file) == cells.size();
+    if (file != NULL && fclose(file) != 0)
+        ok = false;
+    if (!ok)
+        std::cerr << "Couldn't write upstream index " << filename << std::endl;
+    return ok;
+}
+
+// An index file mapped into memory, read only
+struct UpstreamIndex {
+    int max_x = 0, max_y = 0;
+    uint64_t cells = 0;
+    const uint32_t* pre = NULL;
+    const uint32_t* size = NULL;
+    const uint32_t* cell = NULL; // cell_id of the cells in pre-order
+    const void* mapping = NULL;
+    size_t mapped = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, map = NULL;
+#endif
+
+    UpstreamIndex() {}
+    UpstreamIndex(const UpstreamIndex&) = delete;
+    UpstreamIndex& operator=(const UpstreamIndex&) = delete;
+
+    ~UpstreamIndex() {
+        close();
+    }
+
+    // Map filename, false when it is missing or not an index
+    bool open(const std::string& filename) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        LARGE_INTEGER length;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &length))
+            return fail(filename);
+        mapped = (size_t)length.QuadPart;
+        map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        mapping = map == NULL ? NULL : MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        struct stat status;
+        if (fd < 0 || fstat(fd, &status) != 0) {
+            if (fd >= 0)
+                ::close(fd);
+            return fail(filename);
+        }
+        mapped = (size_t)status.st_size;
+        mapping = mapped < sizeof(UpstreamHeader) ? NULL : mmap(NULL, mapped, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+            mapping = NULL;
+#endif
+        if (mapping == NULL || mapped < sizeof(UpstreamHeader))
+            return fail(filename);
+        UpstreamHeader header;
+        memcpy(&header, mapping, sizeof(header));
+        size_t total = (size_t)header.max_x * header.max_y;
+        if (memcmp(header.magic, UPSTREAM_MAGIC, sizeof(header.magic)) != 0
+            || mapped != sizeof(header) + (2 * total + header.cells) * sizeof(uint32_t))
+            return fail(filename);
+        max_x = header.max_x;
+        max_y = header.max_y;
+        cells = header.cells;
+        pre = (const uint32_t*)((const char*)mapping + sizeof(header));
+        size = pre + total;
+        cell = size + total;
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (mapping != NULL)
+            UnmapViewOfFile(mapping);
+        if (map != NULL)
+            CloseHandle(map);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        map = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (mapping != NULL)
+            munmap((void*)mapping, mapped);
+#endif
+        mapping = NULL;
+        pre = size = cell = NULL;
+        max_x = max_y = 0;
+        cells = 0;
+    }
+
+    bool inside(int x, int y) const {
+        return x >= 0 && y >= 0 && x < max_x && y < max_y;
+    }
+
+    // Is (x, y) in the raster and flooded
+    bool indexed(int x, int y) const {
+        return inside(x, y) && pre[(size_t)y * max_x + x] != NOT_INDEXED;
+    }
+
+    // Cells upstream of (x, y), itself included, 0 for cells not indexed
+    uint32_t upstream_cells(int x, int y) const {
+        return inside(x, y) ? size[(size_t)y * max_x + x] : 0;
+    }
+
+    // Does (ax, ay) drain through (bx, by), true for a cell and itself
+    bool is_upstream(int ax, int ay, int bx, int by) const {
+        if (!indexed(ax, ay) || !indexed(bx, by))
+            return false;
+        uint32_t a = pre[(size_t)ay * max_x + ax], b = pre[(size_t)by * max_x + bx];
+        return a >= b && a - b < size[(size_t)by * max_x + bx];
+    }
+
+    // Call visit(x, y) for every cell upstream of (x, y), itself first
+    template <typename Visit>
+    void for_each_upstream(int x, int y, Visit visit) const {
+        if (!indexed(x, y))
+            return;
+        size_t id = (size_t)y * max_x + x;
+        for (uint32_t i = pre[id]; i < pre[id] + size[id]; ++i)
+            visit((int)(cell[i] % max_x), (int)(cell[i] / max_x));
+    }
+
+private:
+    bool fail(const std::string& filename) {
+        std::cerr << "Couldn't map upstream index " << filename << std::endl;
+        close();
+        return false;
+    }
+};